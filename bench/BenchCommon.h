@@ -0,0 +1,33 @@
+#ifndef KALEIDOSCOPE_BENCH_COMMON
+#define KALEIDOSCOPE_BENCH_COMMON
+
+#include <chrono>
+#include <memory>
+
+#include "Engine.h"
+
+// Wall time of running body repetitions times.
+template<typename Body>
+double MeasureSeconds(int repetitions, Body body)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repetitions; i++) {
+        body();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Engine at -O3 with source compiled into it. Returns null if either fails.
+inline std::unique_ptr<Engine> CreateBenchEngine(const char* source)
+{
+    CompilerOptions options;
+    options.optLevel = 3;
+    auto engine = Engine::Create(options);
+    if (!engine || !engine->Compile(source)) {
+        return nullptr;
+    }
+    return engine;
+}
+
+#endif // KALEIDOSCOPE_BENCH_COMMON
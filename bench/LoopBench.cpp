@@ -0,0 +1,60 @@
+// The same computations written as recursion and as a for loop over mutable variables. The
+// recursive versions make a call per step and need a stack frame per step, so the trip count is
+// bounded by the stack; the loops compile to plain loops.
+//
+//     kale_loop_bench [trip count] [repetitions]
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "BenchCommon.h"
+
+static const char* source =
+    "def sumrec(i n) if i < n then i + sumrec(i + 1, n) else 0;\n"
+    "def sumloop(n) var acc in (for i = 0, i < n in acc = acc + i) + acc;\n"
+    "def polyrec(i n) if i < n then (i * 0.001) * (i * 0.001) * 0.5 - i * 0.001 + polyrec(i + 1, n) else 0;\n"
+    "def polyloop(n)\n"
+    "    var acc in\n"
+    "        (for i = 0, i < n in acc = acc + ((i * 0.001) * (i * 0.001) * 0.5 - i * 0.001)) + acc;\n";
+
+int main(int argc, char* argv[])
+{
+    // Deep enough to dwarf the call overhead of the benchmark, shallow enough for the stack.
+    double tripCount = argc > 1 ? std::strtod(argv[1], nullptr) : 50000;
+    int repetitions = argc > 2 ? std::atoi(argv[2]) : 200;
+
+    auto engine = CreateBenchEngine(source);
+    if (!engine) {
+        return 1;
+    }
+
+    struct Workload {
+        const char* name;
+        const char* recursive;
+        const char* looped;
+    };
+    for (const Workload& workload : { Workload { "sum", "sumrec", "sumloop" },
+             Workload { "poly", "polyrec", "polyloop" } }) {
+        auto recursive = engine->GetFunction<double(double, double)>(workload.recursive);
+        auto looped = engine->GetFunction<double(double)>(workload.looped);
+        if (!recursive || !looped) {
+            return 1;
+        }
+        // Keeps the calls from being optimized away.
+        volatile double sink = 0;
+        double recursiveSeconds = MeasureSeconds(repetitions, [&] { sink = recursive(0, tripCount); });
+        double recursiveResult = sink;
+        double loopSeconds = MeasureSeconds(repetitions, [&] { sink = looped(tripCount); });
+        double loopResult = sink;
+        // The recursion adds the terms up from the last one, the loop from the first.
+        if (std::fabs(recursiveResult - loopResult) > 1e-9 * std::fabs(recursiveResult)) {
+            fprintf(stderr, "Error: %s differs: %f != %f\n", workload.name, recursiveResult, loopResult);
+            return 1;
+        }
+        double steps = tripCount * repetitions;
+        printf("%-5s recursive %7.2f ns/step   loop %7.2f ns/step   speedup %.2fx\n", workload.name,
+            recursiveSeconds / steps * 1e9, loopSeconds / steps * 1e9, recursiveSeconds / loopSeconds);
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+// Throughput of applying a compiled function to arrays: a loop calling the function pointer once
+// per element against the vectorized map wrapper.
+//
+//     kale_map_bench [elements] [repetitions]
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "BenchCommon.h"
+
+static const char* source =
+    "def blend(x y) if x - y then x * 0.25 + y * 0.75 else x * y;\n"
+    "def poly(x y) ((x * 0.5 + y) * x - 3) * y + x * x * x;\n";
+
+int main(int argc, char* argv[])
+{
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1 << 20;
+    int repetitions = argc > 2 ? std::atoi(argv[2]) : 20;
+
+    auto engine = CreateBenchEngine(source);
+    if (!engine) {
+        return 1;
+    }
+
+    std::vector<double> x(count), y(count), scalarOut(count), mapOut(count);
+    for (size_t i = 0; i < count; i++) {
+        x[i] = static_cast<double>(i % 1000) / 7;
+        y[i] = static_cast<double>(i % 333) / 3;
+    }
+    const double* inputs[] = { x.data(), y.data() };
+
+    for (const char* name : { "blend", "poly" }) {
+        auto scalar = engine->GetFunction<double(double, double)>(name);
+        auto map = engine->GetMapFunction(name);
+        if (!scalar || !map) {
+            return 1;
+        }
+        double scalarSeconds = MeasureSeconds(repetitions, [&] {
+            for (size_t i = 0; i < count; i++) {
+                scalarOut[i] = scalar(x[i], y[i]);
+            }
+        });
+        double mapSeconds = MeasureSeconds(repetitions, [&] {
+            map(inputs, mapOut.data(), static_cast<int64_t>(count));
+        });
+        for (size_t i = 0; i < count; i++) {
+            if (scalarOut[i] != mapOut[i]) {
+                fprintf(stderr, "Error: %s differs at %zu: %f != %f\n", name, i, scalarOut[i], mapOut[i]);
+                return 1;
+            }
+        }
+        double elements = static_cast<double>(count) * repetitions;
+        printf("%-6s scalar %8.1f Melem/s   map %8.1f Melem/s   speedup %.2fx\n", name,
+            elements / scalarSeconds / 1e6, elements / mapSeconds / 1e6, scalarSeconds / mapSeconds);
+    }
+    return 0;
+}
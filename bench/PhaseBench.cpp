@@ -0,0 +1,234 @@
+// Time spent in each phase of the compiler on synthetic workloads, written to stdout as JSON so
+// runs can be compared between releases:
+//
+//     kale_bench [repetitions] > phases.json
+//
+// Every phase is timed on its own, repetitions times, and reported as the minimum, median and
+// maximum in milliseconds:
+//     lex      Lexer::GetToken() over the whole source
+//     parse    Parser::ParseDefinition() over the whole source, which lexes as it goes
+//     codegen  CodeGenerator::GenerateCodeForFunction() for every definition into one module, also
+//              reported as expression nodes generated per second
+//     opt      CodeGenerator::RunOptmizationPasses() on that module at -O2
+//     jit      KaleidoscopeJIT::addModule() and a lookup of every function, which compiles them
+//     exec     calls through the looked up addresses
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "Codegen.h"
+#include "Kaleidoscope-JIT.h"
+#include "Lexer.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static ExitOnError ExitOnErr;
+
+// Source of single-parameter definitions, and how to run them: every function is called `calls`
+// times with `argument`.
+struct Workload {
+    const char* name;
+    std::string source;
+    double argument;
+    int calls;
+};
+
+// Definitions whose bodies nest `depth` parenthesized expressions, so every phase recurses deeply.
+static std::string DeepTreeSource(int functions, int depth)
+{
+    std::string source;
+    for (int i = 0; i < functions; i++) {
+        std::string body = "x";
+        for (int level = 0; level < depth; level++) {
+            body = "(" + body + " * 0.999 + " + std::to_string(level % 7) + ")";
+        }
+        source += "def deep" + std::to_string(i) + "(x) " + body + ";\n";
+    }
+    return source;
+}
+
+// Many tiny definitions, where the per-function costs of every phase dominate.
+static std::string SmallDefinitionsSource(int functions)
+{
+    std::string source;
+    for (int i = 0; i < functions; i++) {
+        std::string n = std::to_string(i);
+        source += "def small" + n + "(x) x * " + n + " + (x - " + n + ") * 0.5;\n";
+    }
+    return source;
+}
+
+static double Milliseconds(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+struct PhaseTimes {
+    std::vector<double> lex, parse, codegen, opt, jit, exec;
+};
+
+// Expressions in the bodies of definitions.
+static size_t CountNodes(const std::vector<const FunctionAST*>& definitions)
+{
+    size_t nodeCount = 0;
+    auto count = [&](const ExprAST*) {
+        nodeCount++;
+        return true;
+    };
+    for (const FunctionAST* definition : definitions) {
+        VisitExprTree(definition->GetBody(), count);
+    }
+    return nodeCount;
+}
+
+// Runs every phase of the workload once, adding their times. Returns false if any phase failed.
+static bool RunWorkload(const Workload& workload, PhaseTimes& times, size_t& tokenCount, size_t& nodeCount)
+{
+    auto start = std::chrono::steady_clock::now();
+    Lexer lexer(workload.source);
+    tokenCount = 0;
+    while (lexer.GetToken() != tok_eof) {
+        tokenCount++;
+    }
+    times.lex.push_back(Milliseconds(start));
+
+    start = std::chrono::steady_clock::now();
+    ASTContext astContext;
+    Parser parser(workload.source, astContext);
+    std::vector<const FunctionAST*> definitions;
+    for (parser.GetNextToken(); parser.GetCurrentToken() == tok_def;) {
+        const FunctionAST* definition = parser.ParseDefinition();
+        if (!definition) {
+            return false;
+        }
+        definitions.push_back(definition);
+        if (parser.GetCurrentToken() == ';') {
+            parser.GetNextToken();
+        }
+    }
+    times.parse.push_back(Milliseconds(start));
+    nodeCount = CountNodes(definitions);
+
+    // A fresh JIT per run, as every run defines the same names. Setting up the JIT and the pass
+    // managers is not part of any phase.
+    auto jit = ExitOnErr(KaleidoscopeJIT::Create());
+    JITTargetMachineBuilder jtmb = jit->getTargetMachineBuilder();
+    auto targetMachine = ExitOnErr(jtmb.createTargetMachine());
+    CodeGenerator generator;
+    generator.InitializeModule();
+    generator.GetModule()->setDataLayout(jit->getDataLayout());
+    generator.GetModule()->setTargetTriple(targetMachine->getTargetTriple().str());
+    generator.InitializePassManagers(OptimizationLevel::O2, targetMachine.get(), false);
+
+    start = std::chrono::steady_clock::now();
+    for (const FunctionAST* definition : definitions) {
+        RegisterPrototype(definition->GetPrototype());
+        if (!generator.GenerateCodeForFunction(definition)) {
+            return false;
+        }
+    }
+    times.codegen.push_back(Milliseconds(start));
+
+    start = std::chrono::steady_clock::now();
+    generator.RunOptmizationPasses();
+    times.opt.push_back(Milliseconds(start));
+
+    start = std::chrono::steady_clock::now();
+    ExitOnErr(jit->addModule(ThreadSafeModule(generator.GetModuleUniquePtr(), generator.GetContextUniquePtr())));
+    std::vector<double (*)(double)> functions;
+    for (const FunctionAST* definition : definitions) {
+        auto symbol = ExitOnErr(jit->lookup(definition->GetPrototype()->GetName()));
+        functions.push_back(ExecutorAddr(symbol.getAddress()).toPtr<double (*)(double)>());
+    }
+    times.jit.push_back(Milliseconds(start));
+
+    start = std::chrono::steady_clock::now();
+    volatile double sink = 0;
+    for (auto function : functions) {
+        for (int i = 0; i < workload.calls; i++) {
+            sink = sink + function(workload.argument);
+        }
+    }
+    times.exec.push_back(Milliseconds(start));
+
+    // The prototypes live in astContext.
+    for (const FunctionAST* definition : definitions) {
+        UnregisterPrototype(definition->GetPrototype()->GetName());
+    }
+    return true;
+}
+
+// With nodeCount, the phase's throughput at its median time is reported too.
+static void PrintPhase(const char* name, std::vector<double> times, bool last, size_t nodeCount = 0)
+{
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    printf("        \"%s\": { \"min_ms\": %.4f, \"median_ms\": %.4f, \"max_ms\": %.4f", name, times.front(),
+        median, times.back());
+    if (nodeCount != 0) {
+        printf(", \"nodes_per_sec\": %.0f", nodeCount / (median / 1000));
+    }
+    printf(" }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char* argv[])
+{
+    int repetitions = std::max(argc > 1 ? std::atoi(argv[1]) : 5, 1);
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    const Workload workloads[] = {
+        { "deep_tree", DeepTreeSource(16, 400), 1.5, 1000 },
+        { "many_small_defs", SmallDefinitionsSource(4000), 1.5, 100 },
+        { "fib", "def fib(x) if x - 1 then (if x then fib(x-1)+fib(x-2) else 0) else 1;\n", 27, 1 },
+    };
+
+    printf("{\n");
+    printf("  \"llvm_version\": \"%s\",\n", LLVM_VERSION_STRING);
+    printf("  \"opt_level\": 2,\n");
+    printf("  \"repetitions\": %d,\n", repetitions);
+    printf("  \"workloads\": [\n");
+    for (size_t i = 0; i < std::size(workloads); i++) {
+        const Workload& workload = workloads[i];
+        PhaseTimes times;
+        size_t tokenCount = 0;
+        size_t nodeCount = 0;
+        for (int repetition = 0; repetition < repetitions; repetition++) {
+            if (!RunWorkload(workload, times, tokenCount, nodeCount)) {
+                fprintf(stderr, "Error: Workload %s failed\n", workload.name);
+                return 1;
+            }
+        }
+        printf("    {\n");
+        printf("      \"name\": \"%s\",\n", workload.name);
+        printf("      \"source_bytes\": %zu,\n", workload.source.size());
+        printf("      \"tokens\": %zu,\n", tokenCount);
+        printf("      \"nodes\": %zu,\n", nodeCount);
+        printf("      \"phases\": {\n");
+        PrintPhase("lex", times.lex, false);
+        PrintPhase("parse", times.parse, false);
+        PrintPhase("codegen", times.codegen, false, nodeCount);
+        PrintPhase("opt", times.opt, false);
+        PrintPhase("jit", times.jit, false);
+        PrintPhase("exec", times.exec, true);
+        printf("      }\n");
+        printf("    }%s\n", i + 1 == std::size(workloads) ? "" : ",");
+    }
+    printf("  ]\n");
+    printf("}\n");
+    return 0;
+}
@@ -2,12 +2,74 @@
 #define KALEIDOSCOPE_AST
 
 #include <memory>
-#include <string>
-#include <vector>
+#include <type_traits>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/StringSaver.h"
+
+// Owns the nodes and names of a compilation unit. Everything is bump allocated and released in one
+// shot when the context is destroyed, so nodes must be trivially destructible and refer to names
+// and child lists through the context as well.
+class ASTContext {
+private:
+    llvm::BumpPtrAllocator allocator;
+    llvm::UniqueStringSaver names { allocator };
+
+public:
+    template <typename T, typename... Args>
+    T* Create(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "AST nodes are never destroyed");
+        return new (allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+    }
+
+    // Returns the context's single copy of the name.
+    llvm::StringRef Intern(llvm::StringRef name)
+    {
+        return names.save(name);
+    }
+
+    template <typename T>
+    llvm::ArrayRef<T> CopyArray(llvm::ArrayRef<T> items)
+    {
+        T* data = allocator.Allocate<T>(items.size());
+        std::uninitialized_copy(items.begin(), items.end(), data);
+        return llvm::ArrayRef<T>(data, items.size());
+    }
+};
 
 class ExprAST {
 public:
-    virtual ~ExprAST() = default;
+    // Concrete node type, so passes dispatch with a switch instead of trying casts. Also makes the
+    // nodes work with llvm::isa/cast/dyn_cast.
+    enum class Kind { Number, Variable, Binary, Call, If, For, Var };
+
+private:
+    const Kind kind;
+    // Source line the expression starts at, for debug info. 0 if unknown.
+    unsigned line = 0;
+
+protected:
+    ExprAST(Kind kind) : kind(kind) { }
+
+public:
+    Kind GetKind() const
+    {
+        return kind;
+    }
+
+    unsigned GetLine() const
+    {
+        return line;
+    }
+
+    void SetLine(unsigned newLine)
+    {
+        line = newLine;
+    }
 
     void PrettyPrint() const
     {
@@ -27,7 +89,12 @@ private:
     double value;
 
 public:
-    NumberExprAST(double value) : value(value) { }
+    NumberExprAST(double value) : ExprAST(Kind::Number), value(value) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::Number;
+    }
 
     double GetValue() const
     {
@@ -39,12 +106,17 @@ public:
 
 class VariableExprAST : public ExprAST {
 private:
-    std::string name;
+    llvm::StringRef name;
 
 public:
-    VariableExprAST(const std::string& name) : name(name) { }
+    VariableExprAST(llvm::StringRef name) : ExprAST(Kind::Variable), name(name) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::Variable;
+    }
 
-    std::string GetName() const
+    llvm::StringRef GetName() const
     {
         return name;
     }
@@ -57,8 +129,13 @@ private:
     char op;
 
 public:
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-        : op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) { }
+    BinaryExprAST(char op, ExprAST* LHS, ExprAST* RHS)
+        : ExprAST(Kind::Binary), op(op), LHS(LHS), RHS(RHS) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::Binary;
+    }
     
     char GetOp() const
     {
@@ -66,24 +143,29 @@ public:
     }
     
     virtual void PrettyPrint(int indent, int titleIndent) const override;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    ExprAST *LHS, *RHS;
 };
 
 class CallExprAST : public ExprAST {
 private:
-    std::string callee;
-    std::vector<std::unique_ptr<ExprAST>> args;
+    llvm::StringRef callee;
+    llvm::ArrayRef<ExprAST*> args;
 
 public:
-    CallExprAST(const std::string& callee, std::vector<std::unique_ptr<ExprAST>> args)
-        : callee(callee), args(std::move(args)) { }
+    CallExprAST(llvm::StringRef callee, llvm::ArrayRef<ExprAST*> args)
+        : ExprAST(Kind::Call), callee(callee), args(args) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::Call;
+    }
     
-    std::string GetCallee() const
+    llvm::StringRef GetCallee() const
     {
         return callee;
     }
 
-    const std::vector<std::unique_ptr<ExprAST>>& GetArgs() const
+    llvm::ArrayRef<ExprAST*> GetArgs() const
     {
         return args;
     }
@@ -92,73 +174,228 @@ public:
 };
 
 class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> condExp, thenExp, elseExp;
+    ExprAST *condExp, *thenExp, *elseExp;
 
 public:
-    IfExprAST(std::unique_ptr<ExprAST> condExp, std::unique_ptr<ExprAST> thenExp,
-        std::unique_ptr<ExprAST> elseExp)
-        : condExp(std::move(condExp)), thenExp(std::move(thenExp)), elseExp(std::move(elseExp)) { }
+    IfExprAST(ExprAST* condExp, ExprAST* thenExp, ExprAST* elseExp)
+        : ExprAST(Kind::If), condExp(condExp), thenExp(thenExp), elseExp(elseExp) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::If;
+    }
 
     ExprAST* GetCondtionExpr() const
     {
-        return condExp.get();
+        return condExp;
     }
 
     ExprAST* GetThenExpr() const
     {
-        return thenExp.get();
+        return thenExp;
     }
 
     ExprAST* GetElseExpr() const
     {
-        return elseExp.get();
+        return elseExp;
     } 
 
     void PrettyPrint(int indent, int titleIndent) const override;
 };
 
+// for var = start, end, step in body
+// Runs body while end is nonzero, evaluating end before every iteration, then adds step (1 by
+// default) to var. var is a new variable, visible in end, step and body. Evaluates to 0.
+class ForExprAST : public ExprAST {
+    llvm::StringRef varName;
+    ExprAST *start, *end, *step, *body;
+
+public:
+    ForExprAST(llvm::StringRef varName, ExprAST* start, ExprAST* end, ExprAST* step, ExprAST* body)
+        : ExprAST(Kind::For), varName(varName), start(start), end(end), step(step), body(body) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::For;
+    }
+
+    llvm::StringRef GetVarName() const
+    {
+        return varName;
+    }
+
+    ExprAST* GetStartExpr() const
+    {
+        return start;
+    }
+
+    ExprAST* GetEndExpr() const
+    {
+        return end;
+    }
+
+    // Null if the loop steps by 1.
+    ExprAST* GetStepExpr() const
+    {
+        return step;
+    }
+
+    ExprAST* GetBodyExpr() const
+    {
+        return body;
+    }
+
+    void PrettyPrint(int indent, int titleIndent) const override;
+};
+
+// var a = 1, b in body
+// Declares mutable variables, initialized to 0 if no value is given, and evaluates to body.
+// Variables, parameters included, are assigned with "name = value".
+class VarExprAST : public ExprAST {
+public:
+    struct Binding {
+        llvm::StringRef name;
+        // Null if the variable starts at 0.
+        ExprAST* init;
+    };
+
+private:
+    llvm::ArrayRef<Binding> bindings;
+    ExprAST* body;
+
+public:
+    VarExprAST(llvm::ArrayRef<Binding> bindings, ExprAST* body)
+        : ExprAST(Kind::Var), bindings(bindings), body(body) { }
+
+    static bool classof(const ExprAST* expr)
+    {
+        return expr->GetKind() == Kind::Var;
+    }
+
+    llvm::ArrayRef<Binding> GetBindings() const
+    {
+        return bindings;
+    }
+
+    ExprAST* GetBodyExpr() const
+    {
+        return body;
+    }
+
+    void PrettyPrint(int indent, int titleIndent) const override;
+};
+
 class PrototypeAST {
 private:
-    std::string name;
-    std::vector<std::string> args;
+    llvm::StringRef name;
+    llvm::ArrayRef<llvm::StringRef> args;
+    unsigned line;
+    bool isExtern;
 
 public:
-    PrototypeAST(const std::string& name, std::vector<std::string> args)
-        : name(name), args(std::move(args)) { }
+    PrototypeAST(llvm::StringRef name, llvm::ArrayRef<llvm::StringRef> args, unsigned line = 0,
+        bool isExtern = false)
+        : name(name), args(args), line(line), isExtern(isExtern) { }
 
-    const std::string& GetName() const
+    llvm::StringRef GetName() const
     {
         return name;
     }
 
-    const std::vector<std::string>& GetArgs() const
+    llvm::ArrayRef<llvm::StringRef> GetArgs() const
     {
         return args;
     }
 
+    // Line of the function name, for debug info. 0 if unknown.
+    unsigned GetLine() const
+    {
+        return line;
+    }
+
+    // Declared with "extern", so the function comes from the process.
+    bool IsExtern() const
+    {
+        return isExtern;
+    }
+
     void PrettyPrint() const;
 };
 
+// Calls visit on exprAST and every expression under it, parents first, until it returns false.
+// Returns false if it did.
+template<typename Visitor>
+bool VisitExprTree(const ExprAST* exprAST, Visitor& visit)
+{
+    if (!visit(exprAST)) {
+        return false;
+    }
+    switch (exprAST->GetKind()) {
+        case ExprAST::Kind::Number:
+        case ExprAST::Kind::Variable:
+            return true;
+        case ExprAST::Kind::Binary:
+            return VisitExprTree(llvm::cast<BinaryExprAST>(exprAST)->LHS, visit) &&
+                VisitExprTree(llvm::cast<BinaryExprAST>(exprAST)->RHS, visit);
+        case ExprAST::Kind::Call:
+            for (const ExprAST* arg : llvm::cast<CallExprAST>(exprAST)->GetArgs()) {
+                if (!VisitExprTree(arg, visit)) {
+                    return false;
+                }
+            }
+            return true;
+        case ExprAST::Kind::If: {
+            auto ifExprAST = llvm::cast<IfExprAST>(exprAST);
+            return VisitExprTree(ifExprAST->GetCondtionExpr(), visit) &&
+                VisitExprTree(ifExprAST->GetThenExpr(), visit) && VisitExprTree(ifExprAST->GetElseExpr(), visit);
+        }
+        case ExprAST::Kind::For: {
+            auto forExprAST = llvm::cast<ForExprAST>(exprAST);
+            return VisitExprTree(forExprAST->GetStartExpr(), visit) &&
+                VisitExprTree(forExprAST->GetEndExpr(), visit) &&
+                (!forExprAST->GetStepExpr() || VisitExprTree(forExprAST->GetStepExpr(), visit)) &&
+                VisitExprTree(forExprAST->GetBodyExpr(), visit);
+        }
+        case ExprAST::Kind::Var: {
+            auto varExprAST = llvm::cast<VarExprAST>(exprAST);
+            for (const VarExprAST::Binding& binding : varExprAST->GetBindings()) {
+                if (binding.init && !VisitExprTree(binding.init, visit)) {
+                    return false;
+                }
+            }
+            return VisitExprTree(varExprAST->GetBodyExpr(), visit);
+        }
+    }
+    return true;
+}
+
 class FunctionAST {
 private:
-    std::unique_ptr<PrototypeAST> prototype;
-    std::unique_ptr<ExprAST> body;
+    PrototypeAST* prototype;
+    ExprAST* body;
+    bool memoized;
 
 public:
-    FunctionAST(std::unique_ptr<PrototypeAST> prototype, std::unique_ptr<ExprAST> body)
-        : prototype(std::move(prototype)), body(std::move(body)) { }
+    FunctionAST(PrototypeAST* prototype, ExprAST* body, bool memoized = false)
+        : prototype(prototype), body(body), memoized(memoized) { }
     
     const PrototypeAST* GetPrototype() const
     {
-        return prototype.get();
+        return prototype;
     }
 
     const ExprAST* GetBody() const
     {
-        return body.get();
+        return body;
+    }
+
+    // Defined with "memo def", which caches the results of calls by their arguments.
+    bool IsMemoized() const
+    {
+        return memoized;
     }
 
     void PrettyPrint() const;
 };
 
-#endif // KALEIDOSCOPE_AST
\ No newline at end of file
+#endif // KALEIDOSCOPE_AST
@@ -1,17 +1,153 @@
 #ifndef KALEIDOSCOPE_CODEGEN
 #define KALEIDOSCOPE_CODEGEN
 
+#include <functional>
+#include <optional>
+#include <string>
+
 #include "AST.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+
+namespace llvm {
+class TargetMachine;
+}
+
+// Makes a function callable from modules generated later, including on other threads. Modules
+// only see a function defined in another module through its prototype.
+void RegisterPrototype(const PrototypeAST* prototypeAST);
+// Forgets a function whose definition failed to compile, so later modules report it as unknown.
+void UnregisterPrototype(llvm::StringRef name);
+// The registered prototype of a function, or null.
+const PrototypeAST* LookupPrototype(llvm::StringRef name);
+// Whether prototypeAST is an extern of a C math function, like sin or pow, whose calls are
+// generated as the matching intrinsic. The optimizer knows those to have no side effects, so it
+// folds them on constants, hoists them out of loops and vectorizes them.
+bool IsMathBuiltin(const PrototypeAST* prototypeAST);
+// Number of profile counters of functionAST: one for its calls, then two for every if and loop,
+// counting the times each way out of the condition is taken.
+size_t ProfileCounterCount(const FunctionAST* functionAST);
+
+// Results of a memoized function, in memory of the compiler whose address is built into the code.
+// Slots are picked by a hash of the arguments. Each holds a sequence number, then the bits of the
+// arguments and of the result. The number is 0 while the slot is empty and odd while a call writes
+// it, and lookups check it did not change while they read, so threads can share the cache.
+struct MemoCache {
+    // capacity * (argument count + 2) values. capacity is a power of two.
+    uint64_t* slots = nullptr;
+    size_t capacity = 0;
+    // Whether a new result replaces the one in its slot, or the slot keeps its first result.
+    bool replace = true;
+    // Hits, then misses.
+    uint64_t* counters = nullptr;
+};
+
+// Picks the function a call passing some literal arguments goes to. Returns the name of a function
+// taking only the other arguments, in order, or an empty string for a regular call.
+using CallSpecializer = std::function<std::string(llvm::StringRef callee, llvm::ArrayRef<ExprAST*> args)>;
+
+// Generates one module at a time into a context of its own. Generators on different threads are
+// independent apart from the shared prototype table.
+class CodeGenerator {
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::Module> module;
+    std::unique_ptr<llvm::IRBuilder<>> builder;
+    // Stack slot of every variable in scope. Parameters are copied into slots too, so they can be
+    // assigned; mem2reg and SROA turn the slots back into registers.
+    llvm::StringMap<llvm::AllocaInst*> namedValues;
+
+    // Source file the debug info refers to. Empty unless debug info is generated.
+    std::string debugFile;
+    std::unique_ptr<llvm::DIBuilder> debugBuilder;
+    llvm::DICompileUnit* debugUnit = nullptr;
+    // Subprogram of the function being generated.
+    llvm::DISubprogram* debugScope = nullptr;
+
+    // Profile of the function being generated, which either updates profileCounters or gets
+    // branch weights from profileCounts. Branches take counters in the order they are generated.
+    uint64_t* profileCounters = nullptr;
+    const uint64_t* profileCounts = nullptr;
+    size_t nextCounter = 0;
+
+    CallSpecializer callSpecializer;
+    llvm::TargetLibraryInfoImpl::VectorLibrary vectorLibrary = llvm::TargetLibraryInfoImpl::NoLibrary;
+    // Cache of the function being generated, if it is memoized.
+    const MemoCache* memoCache = nullptr;
+
+    std::unique_ptr<llvm::ModulePassManager> mpm;
+    std::unique_ptr<llvm::LoopAnalysisManager> lam;
+    std::unique_ptr<llvm::FunctionAnalysisManager> fam;
+    std::unique_ptr<llvm::CGSCCAnalysisManager> cgam;
+    std::unique_ptr<llvm::ModuleAnalysisManager> mam;
+    std::unique_ptr<llvm::PassInstrumentationCallbacks> pic;
+    std::unique_ptr<llvm::StandardInstrumentations> si;
 
-void InitializeModule();
-void InitializePassManagers();
+    llvm::Function* GetFunction(llvm::StringRef name);
+    llvm::Value* GenerateCodeForExpr(const ExprAST* exprAST);
+    llvm::Value* GenerateCodeForNumberExpr(const NumberExprAST* numberExprAST);
+    llvm::Value* GenerateCodeForVariableExpr(const VariableExprAST* variableExprAST);
+    llvm::Value* GenerateCodeForBinaryExpr(const BinaryExprAST* binaryExprAST);
+    llvm::Value* GenerateCodeForAssignment(const BinaryExprAST* binaryExprAST);
+    llvm::Value* GenerateCodeForCallExpr(const CallExprAST* callExprAST);
+    llvm::Value* GenerateCodeForSpecializedCall(const CallExprAST* callExprAST, llvm::StringRef name);
+    llvm::Value* GenerateCodeForIfExpr(const IfExprAST* ifExprAST);
+    llvm::Value* GenerateCodeForForExpr(const ForExprAST* forExprAST);
+    llvm::Value* GenerateCodeForVarExpr(const VarExprAST* varExprAST);
+    llvm::Function* GenerateCodeForMemoizedEntry(llvm::Function* body, const MemoCache& cache);
+    llvm::AllocaInst* CreateVariable(llvm::StringRef name, unsigned line, unsigned argNo = 0);
+    void IncrementProfileCounter(size_t index);
+    llvm::MDNode* GetBranchWeights(size_t index);
+    void StartDebugFunction(llvm::Function* f, const PrototypeAST* prototypeAST);
+public:
+    // Describes the functions of the modules initialized from now on, and the source line of every
+    // expression, in DWARF debug info referring to fileName.
+    void EnableDebugInfo(std::string fileName);
+    void InitializeModule();
+    // Lets specializer redirect the calls passing literal arguments in this and later modules.
+    void SetCallSpecializer(CallSpecializer specializer);
+    // Lets the vectorizers call library for math builtins in the pipelines built from now on. The
+    // JIT must be able to find its functions.
+    void UseVectorLibrary(llvm::TargetLibraryInfoImpl::VectorLibrary library);
+    // Builds the default per-module pipeline for the given level. The target machine, when given,
+    // provides cost models for the inliner and the vectorizers. It is not thread-safe, so every
+    // thread needs one of its own.
+    void InitializePassManagers(llvm::OptimizationLevel level, llvm::TargetMachine* targetMachine,
+        bool debugLogging);
 
-std::unique_ptr<llvm::LLVMContext> GetContextUniquePtr();
-std::unique_ptr<llvm::Module> GetModuleUniquePtr();
-llvm::Module* GetModule();
-llvm::Function* GenerateCodeForPrototype(const PrototypeAST* prototypeAST);
-llvm::Function* GenerateCodeForFunction(const FunctionAST* functionAST);
-llvm::Function* RunOptmizationPasses(llvm::Function* f);
+    std::unique_ptr<llvm::LLVMContext> GetContextUniquePtr();
+    std::unique_ptr<llvm::Module> GetModuleUniquePtr();
+    llvm::Module* GetModule();
+    llvm::Function* GenerateCodeForPrototype(const PrototypeAST* prototypeAST);
+    llvm::Function* GenerateCodeForFunction(const FunctionAST* functionAST);
+    // Makes the next function generated count its calls and branches into counters, which hold
+    // ProfileCounterCount() values and must outlive the code.
+    void InstrumentNextFunction(uint64_t* counters);
+    // Gives the next function generated the entry count and branch weights of counts, collected by
+    // a version instrumented with InstrumentNextFunction().
+    void UseProfileForNextFunction(const uint64_t* counts);
+    // Puts cache, which must outlive the code, in front of the next function generated. Calls
+    // look up their arguments in it first, and only run the body on a miss.
+    void MemoizeNextFunction(const MemoCache* cache);
+    // Generates a private copy of the function and wrapperName, which applies it element-wise to
+    // arrays: void wrapperName(const double* const* inputs, double* output, int64_t count), with
+    // one input array per parameter. The loop reads the arrays through noalias pointers, so once
+    // the copy is inlined into it the vectorizers can process several elements per iteration.
+    llvm::Function* GenerateCodeForMapWrapper(const FunctionAST* functionAST, llvm::StringRef wrapperName);
+    // Generates name, which calls generic with the arguments that have a value in constants and
+    // passes its own parameters for the others. generic is made internal and always inlined, so
+    // the optimizer folds its code for the constants.
+    llvm::Function* GenerateCodeForSpecialization(llvm::Function* generic,
+        llvm::ArrayRef<std::optional<double>> constants, llvm::StringRef name);
+    // Runs the pipeline over the whole module, so calls between its functions can be inlined.
+    llvm::Module* RunOptmizationPasses();
+};
 
-#endif // KALEIDOSCOPE_CODEGEN
\ No newline at end of file
+#endif // KALEIDOSCOPE_CODEGEN
@@ -1,6 +1,122 @@
 #ifndef KALEIDOSCOPE_COMPILER_INSTANCE
 #define KALEIDOSCOPE_COMPILER_INSTANCE
 
-void ReadEvalPrintLoop();
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+
+struct CompilerOptions {
+    // Compile each function to machine code on its first call instead of when it is defined.
+    bool lazy = false;
+    // 0 to 3, like -O0 to -O3. Selects both the IR pipeline and the JIT code generator level.
+    unsigned optLevel = 2;
+    // Directory keeping compiled objects between runs. Empty disables the cache.
+    std::string cacheDir;
+    // Compile options.inputFile ahead of time into an object file or a shared library at these
+    // paths instead of running it.
+    std::string emitObject;
+    std::string emitShared;
+    // Source file to run instead of reading the REPL from stdin.
+    std::string inputFile;
+    // Evaluate this function of options.inputFile on every row of mapInput instead of running the
+    // file's top-level expressions for their output.
+    std::string mapFunction;
+    // Rows for mapFunction. Empty or "-" reads stdin.
+    std::string mapInput;
+    // The rows are raw doubles instead of lines of comma separated values.
+    bool mapBinary = false;
+    // Threads evaluating the rows.
+    unsigned mapThreads = std::thread::hardware_concurrency();
+    // Threads used to parse the input file.
+    unsigned parseThreads = std::thread::hardware_concurrency();
+    // Threads generating and optimizing the definitions of the input file.
+    unsigned compileThreads = std::thread::hardware_concurrency();
+    // Run top-level expressions and new functions in an interpreter, and compile a function once
+    // the interpreter has called it this many times. Functions and expressions with loops are
+    // compiled right away. 0 compiles everything up front.
+    unsigned tierThreshold = 0;
+    // Make compiled functions count their calls and branches, and recompile a function at -O3 with
+    // its branch weights in the background once its calls and branches add up to this many. The
+    // new version replaces the old one in its stub while the program runs. 0 disables profiling.
+    uint64_t reoptimizeThreshold = 0;
+    // Compile calls passing literal arguments to a copy of the callee folded for those values, for
+    // up to this many distinct callee and literal combinations. 0 disables specialization.
+    unsigned specializationCacheSize = 0;
+    // Slots in the cache of each function defined with "memo def", rounded up to a power of two.
+    size_t memoCapacity = 4096;
+    // Whether a result replaces the one in its slot, or slots keep their first result until the
+    // function is redefined.
+    bool memoReplace = true;
+    // Library the vectorizers call for math builtins, like clang's -fveclib: libmvec, SVML, MASSV,
+    // Accelerate or Darwin_libsystem_m. Empty vectorizes them only where the target has
+    // instructions for them.
+    std::string vectorLibrary;
+    // Shared library the JIT loads the vector library's functions from, and ahead of time
+    // compiled shared libraries link against. libmvec defaults to glibc's. Others are expected in
+    // the process already.
+    std::string vectorLibraryPath;
+    // Print the AST of every item.
+    bool dumpAST = false;
+    // Print the IR of every item before and after optimization.
+    bool dumpIR = false;
+    // Log every pass run by the pass managers.
+    bool debugPassManager = false;
+    // Print a prompt before reading each REPL input.
+    bool prompt = false;
+    // Print the value of every top-level expression.
+    bool printResults = true;
+    // Report the time every item spends in each phase, and in each pass, as JSON lines on stderr
+    // or in timePhasesFile. Sessions end with a line of totals.
+    bool timePhases = false;
+    std::string timePhasesFile;
+    // Add LLVM's statistics to the totals.
+    bool statistics = false;
+    // Generate DWARF debug info with the source line of every expression.
+    bool debugInfo = false;
+    // Name the JIT's functions for perf in /tmp/perf-<pid>.map, and in jitdump files too when LLVM
+    // is built with perf support.
+    bool perfMap = false;
+    // Register the JIT's objects with GDB, which then sees their functions and debug info.
+    bool gdbRegistration = false;
+};
+
+// Sets up the JIT. A process has a single compiler session, which lasts until it exits. Returns
+// false if it is already running.
+bool InitializeSession(const CompilerOptions& options);
+// Compiles and runs every item of source in order, in the running session. Definitions replace
+// earlier ones of the same name. Returns false if any item failed to parse or compile.
+bool RunSource(std::string_view source);
+// Address of the stub of a function defined in the session, which always calls its latest
+// version. Returns null if there is no such function taking argCount arguments.
+void* GetFunctionAddress(std::string_view name, size_t argCount);
+
+// Applies a function element-wise to count elements of arrays, one input array per parameter.
+using MapFunction = void (*)(const double* const* inputs, double* output, int64_t count);
+// Map function for the current definition of a function defined in the session, compiled on first
+// use. Unlike stubs, it keeps running the definition it was compiled from. Returns null if there
+// is no such function.
+MapFunction GetMapFunction(std::string_view name);
+
+// How the cache of a memoized function's current definition has been used.
+struct MemoStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t capacity = 0;
+};
+// Returns false if there is no such function with a cache.
+bool GetMemoStats(std::string_view name, MemoStats& stats);
+
+void ReadEvalPrintLoop(const CompilerOptions& options);
+// Compiles and runs every item of options.inputFile, printing only results and the total wall time.
+// Errors go to stderr. Returns false if the file cannot be read or any item failed.
+bool RunFile(const CompilerOptions& options);
+// Compiles options.inputFile, then streams the rows of options.mapInput through the map function
+// of options.mapFunction, writing the results to stdout. Returns false on any error.
+bool MapFile(const CompilerOptions& options);
+// Compiles the definitions of options.inputFile into options.emitObject and options.emitShared.
+// Each function gets a C symbol of its own name taking and returning doubles. Externs are left for
+// the linker to resolve. Returns false on any error.
+bool CompileFile(const CompilerOptions& options);
 
 #endif // KALEIDOSCOPE_COMPILER_INSTANCE
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef KALEIDOSCOPE_ENGINE
+#define KALEIDOSCOPE_ENGINE
+
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <type_traits>
+
+#include "CompilerInstance.h"
+
+// Compiles Kaleidoscope source in-process and hands out plain function pointers to the result,
+// for programs that embed the compiler:
+//
+//     auto engine = Engine::Create();
+//     engine->Compile("def mix(a b) a * 0.25 + b * 0.75;");
+//     auto mix = engine->GetFunction<double(double, double)>("mix");
+//     double value = mix(1, 2);
+//
+// A function pointer calls the function through its stub, so it stays valid for the life of the
+// process and always runs the latest definition. Pointers may be called from any number of
+// threads, also while Compile() is redefining the functions behind them. The engine runs the
+// process's only compiler session, so there can be one engine per process and it cannot be
+// combined with RunFile() or ReadEvalPrintLoop().
+class Engine {
+    // Compilation and lookups share the session state.
+    std::mutex sessionMutex;
+
+    Engine() = default;
+
+    template<typename Signature>
+    struct KernelTraits {
+        static constexpr bool valid = false;
+    };
+    template<typename... Args>
+    struct KernelTraits<double(Args...)> {
+        static constexpr bool valid = (std::is_same_v<Args, double> && ...);
+        static constexpr size_t argCount = sizeof...(Args);
+    };
+
+    void* GetFunctionAddress(std::string_view name, size_t argCount);
+public:
+    // Starts the compiler session with the given options; only the optimization level, laziness,
+    // thread counts, tier threshold, specialization cache size, memoization settings and cache
+    // directory apply. Returns null if a session is already running.
+    static std::unique_ptr<Engine> Create(const CompilerOptions& options = CompilerOptions());
+
+    // Compiles every definition and extern of source and runs its top-level expressions without
+    // printing them. Errors are reported on stderr. Returns false if any item failed.
+    bool Compile(std::string_view source);
+
+    // Returns the function named name, which must take only doubles and return a double, or null
+    // if there is no such function with that many arguments.
+    template<typename Signature>
+    Signature* GetFunction(std::string_view name)
+    {
+        static_assert(KernelTraits<Signature>::valid, "Kaleidoscope functions take and return doubles");
+        return reinterpret_cast<Signature*>(GetFunctionAddress(name, KernelTraits<Signature>::argCount));
+    }
+
+    // Returns a function applying name element-wise to arrays, for example
+    //     const double* inputs[] = { a, b };
+    //     engine->GetMapFunction("mix")(inputs, out, n);
+    // The loop is vectorized for the host CPU. It keeps running the definition current when it was
+    // first requested; call GetMapFunction() again after redefining name. Null if there is no such
+    // function.
+    MapFunction GetMapFunction(std::string_view name);
+
+    // Hits and misses of the cache of a function defined with "memo def". Returns false if there
+    // is no such function with a cache.
+    bool GetMemoStats(std::string_view name, MemoStats& stats);
+};
+
+#endif // KALEIDOSCOPE_ENGINE
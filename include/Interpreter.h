@@ -0,0 +1,57 @@
+#ifndef KALEIDOSCOPE_INTERPRETER
+#define KALEIDOSCOPE_INTERPRETER
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "AST.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+// Most arguments the interpreter passes to compiled code.
+constexpr size_t maxNativeCallArgs = 8;
+
+// Reports the errors code generation would find in function: unknown variables and functions,
+// calls with the wrong number of arguments and assignments to anything but a variable. The
+// interpreter relies on it, as it only checks names as it reaches them. Returns false on error.
+bool CheckFunction(const FunctionAST* function);
+// Whether function is better off interpreted until it is hot. Loops are not, as a call cannot
+// leave the interpreter halfway, and neither are calls with more than maxNativeCallArgs arguments
+// or memoized functions, whose cache is in the compiled code.
+bool IsWorthInterpreting(const FunctionAST* function);
+// Adds the names of the functions function calls to callees, once each.
+void CollectCallees(const FunctionAST* function, llvm::SmallVectorImpl<llvm::StringRef>& callees);
+
+// What a call made by the interpreter runs: a definition to interpret, or compiled code taking and
+// returning doubles.
+struct CallTarget {
+    const FunctionAST* definition = nullptr;
+    void* address = nullptr;
+};
+
+// Evaluates checked functions by walking their AST, which costs nothing up front. Calls go through
+// resolveCall, which decides whether the callee is interpreted or runs compiled code and reports
+// the error if it cannot be called.
+class Interpreter {
+    std::function<bool(llvm::StringRef name, CallTarget& target)> resolveCall;
+    // Variables in scope, innermost last. The ones of the running function start at frameBase.
+    std::vector<std::pair<llvm::StringRef, double>> variables;
+    size_t frameBase = 0;
+
+    double* LookupVariable(llvm::StringRef name);
+    bool Evaluate(const ExprAST* exprAST, double& result);
+    bool EvaluateBinaryExpr(const BinaryExprAST* binaryExprAST, double& result);
+    bool EvaluateCallExpr(const CallExprAST* callExprAST, double& result);
+    bool EvaluateForExpr(const ForExprAST* forExprAST);
+    bool EvaluateVarExpr(const VarExprAST* varExprAST, double& result);
+public:
+    explicit Interpreter(std::function<bool(llvm::StringRef name, CallTarget& target)> resolveCall)
+        : resolveCall(std::move(resolveCall)) { }
+
+    // Runs function with args, which must match its parameters. Returns false after an error.
+    bool Run(const FunctionAST* function, llvm::ArrayRef<double> args, double& result);
+};
+
+#endif // KALEIDOSCOPE_INTERPRETER
@@ -1,6 +1,11 @@
 #ifndef KALEIDOSCOPE_LEXER
 #define KALEIDOSCOPE_LEXER
 
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #include "AST.h"
 
 enum Token {
@@ -16,12 +21,140 @@ enum Token {
     tok_if = -6,
     tok_then = -7,
     tok_else = -8,
+    tok_for = -9,
+    tok_in = -10,
+
+    // mutable variables
+    tok_var = -11,
+
+    // memoization
+    tok_memo = -12,
+};
+
+// Turns source text into tokens. The lexer scans a buffer: either one it is given, which must
+// outlive it, or chunks it reads from stdin so interactive input still arrives line by line.
+class Lexer {
+private:
+    std::vector<char> stdinBuffer;
+    bool fromStdin;
+    bool stdinExhausted = false;
+    const char* inputCur = nullptr;
+    const char* inputEnd = nullptr;
+    // Start of the token being scanned. Refilling from stdin keeps everything from here on.
+    const char* tokenStart = nullptr;
+
+    std::string_view identifierStr;
+    double numVal = 0;
+    // Lines are counted from 1 for debug info. tokenLine is the line of the last token.
+    unsigned line = 1;
+    unsigned tokenLine = 1;
+
+    bool FillInput();
+    int PeekChar() const;
+
+public:
+    // Reads from stdin.
+    Lexer();
+    // firstLine is the line number of the start of source, which may be a piece of a file.
+    explicit Lexer(std::string_view source, unsigned firstLine = 1);
+
+    int GetToken();
+
+    unsigned GetLine() const
+    {
+        return tokenLine;
+    }
+
+    // Slice of the input, valid until the next call to GetToken().
+    std::string_view GetIdentifier() const
+    {
+        return identifierStr;
+    }
+
+    double GetNumber() const
+    {
+        return numVal;
+    }
+};
+
+// A command of the REPL:
+//     ":map name [x0, x1, ...] [y0, y1, ...]" applies name element-wise to the lists, one list per
+//     parameter.
+//     ":memo name" prints the hits and misses of the cache of a memoized function.
+struct ReplCommand {
+    enum Kind { Map, Memo };
+
+    Kind kind = Map;
+    std::string function;
+    std::vector<std::vector<double>> inputs;
+};
+
+// Parses into an ASTContext, which owns the returned nodes.
+class Parser {
+private:
+    Lexer lexer;
+    ASTContext* context;
+    int currentToken = 0;
+
+    int GetTokPrecendence() const;
+    ExprAST* ParseExpression();
+    ExprAST* ParseNumberExpr();
+    ExprAST* ParseParenthesisExpr();
+    ExprAST* ParseIdentifierExpr();
+    ExprAST* ParseIfExpr();
+    ExprAST* ParseForExpr();
+    ExprAST* ParseVarExpr();
+    ExprAST* ParsePrimary();
+    ExprAST* ParseBinOpRHS(int exprPrec, ExprAST* LHS);
+    PrototypeAST* ParsePrototype(bool isExtern = false);
+
+public:
+    // Parses stdin.
+    explicit Parser(ASTContext& context) : context(&context) { }
+    Parser(std::string_view source, ASTContext& context, unsigned firstLine = 1)
+        : lexer(source, firstLine), context(&context) { }
+
+    ASTContext& GetASTContext() const
+    {
+        return *context;
+    }
+
+    // Nodes parsed from now on are allocated in the given context.
+    void SetASTContext(ASTContext& newContext)
+    {
+        context = &newContext;
+    }
+
+    int GetCurrentToken() const
+    {
+        return currentToken;
+    }
+
+    int GetNextToken();
+    PrototypeAST* ParseExtern();
+    FunctionAST* ParseDefinition();
+    FunctionAST* ParseTopLevelExpr();
+    // Parses a REPL command starting at the current ':' token. Returns false after reporting an
+    // error.
+    bool ParseCommand(ReplCommand& command);
+};
+
+// One top-level construct of a source file.
+struct TopLevelItem {
+    enum Kind { Definition, Extern, Expression };
+
+    Kind kind;
+    // Set for definitions and expressions. Null if the item failed to parse.
+    FunctionAST* function;
+    // Set for externs. Null if the item failed to parse.
+    PrototypeAST* prototype;
 };
 
-int GetCurrentToken();
-int GetNextToken();
-std::unique_ptr<PrototypeAST> ParseExtern();
-std::unique_ptr<FunctionAST> ParseDefinition();
-std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+// Parses a whole source file. The source is split at top-level def/extern boundaries and the
+// pieces are parsed on up to threadCount threads, each into an ASTContext of its own that is added
+// to `contexts`. Items are returned in source order; those that fail to parse are reported and
+// returned without an AST.
+std::vector<TopLevelItem> ParseSource(std::string_view source, unsigned threadCount,
+    std::vector<std::unique_ptr<ASTContext>>& contexts);
 
-#endif // KALEIDOSCOPE_LEXER
\ No newline at end of file
+#endif // KALEIDOSCOPE_LEXER
@@ -0,0 +1,31 @@
+#ifndef KALEIDOSCOPE_OBJECT_CACHE
+#define KALEIDOSCOPE_OBJECT_CACHE
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+
+// Keeps the objects the JIT compiles in a directory, so later runs load them instead of running
+// the code generator again. An object is keyed by the SHA-1 of the module's bitcode together with
+// everything else that changes the generated code: the target, the optimization level and the
+// LLVM version. Modules reach the compiler already optimized, so the key covers the optimized IR.
+class DiskObjectCache : public llvm::ObjectCache {
+    std::string directory;
+    std::string configuration;
+    // Keys computed by getObject() on a miss, waiting for the compiled object. The compiler may
+    // run on several threads.
+    std::mutex pendingMutex;
+    std::map<const llvm::Module*, std::string> pendingKeys;
+
+    std::string ComputeKey(const llvm::Module* module) const;
+public:
+    // configuration describes the target and the compiler settings, see the class comment.
+    DiskObjectCache(std::string directory, std::string configuration);
+
+    void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override;
+};
+
+#endif
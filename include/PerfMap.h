@@ -0,0 +1,27 @@
+#ifndef KALEIDOSCOPE_PERF_MAP
+#define KALEIDOSCOPE_PERF_MAP
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+// Writes the address, size and name of every function the JIT loads to /tmp/perf-<pid>.map, where
+// perf looks up the symbols of code that no file on disk maps.
+class PerfMapListener : public llvm::JITEventListener {
+    // Objects are loaded on the JIT's compile threads.
+    std::mutex fileMutex;
+    FILE* file;
+
+    explicit PerfMapListener(FILE* file) : file(file) { }
+public:
+    // Returns null after reporting an error if the map cannot be created.
+    static std::unique_ptr<PerfMapListener> Create();
+    ~PerfMapListener() override;
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile& object,
+        const llvm::RuntimeDyld::LoadedObjectInfo& info) override;
+};
+
+#endif // KALEIDOSCOPE_PERF_MAP
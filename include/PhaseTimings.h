@@ -0,0 +1,54 @@
+#ifndef KALEIDOSCOPE_PHASE_TIMINGS
+#define KALEIDOSCOPE_PHASE_TIMINGS
+
+#include <chrono>
+#include <string>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace llvm {
+class PassInstrumentationCallbacks;
+}
+
+// The stages an item of the session goes through. Items parsed ahead of running a file share a
+// single parse, which is reported as an item of its own.
+enum class Phase { Parse, Codegen, Optimize, JIT, Execute };
+constexpr size_t phaseCount = 5;
+
+// Milliseconds spent in each phase. Phases that run on several threads at once add up the time
+// of every thread.
+struct PhaseTimes {
+    double milliseconds[phaseCount] = {};
+
+    PhaseTimes& operator+=(const PhaseTimes& other);
+};
+
+// Starts timing. Every item is written as a JSON line to outputPath, or to stderr if it is empty,
+// and ReportSessionTimes() adds a line with the totals. The time of every pass and analysis run
+// is recorded too, and with statistics on, LLVM's statistics are added to the totals.
+bool EnablePhaseTimings(const std::string& outputPath, bool statistics);
+bool PhaseTimingsEnabled();
+
+// Adds the time from construction to destruction to one phase of times. Costs nothing unless
+// timing is on.
+class PhaseTimer {
+    double* target = nullptr;
+    std::chrono::steady_clock::time_point start;
+public:
+    PhaseTimer(PhaseTimes& times, Phase phase);
+    ~PhaseTimer();
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+};
+
+// Times the passes and analyses run through pic, into the session totals.
+void RegisterPassTimers(llvm::PassInstrumentationCallbacks& pic);
+
+// Writes the times of a finished item, which defined or ran the named functions, and adds them to
+// the session totals. Clears times for the next item. May be called from any thread.
+void ReportItemTimes(llvm::StringRef kind, llvm::ArrayRef<std::string> names, PhaseTimes& times);
+// Writes the session totals so far.
+void ReportSessionTimes();
+
+#endif // KALEIDOSCOPE_PHASE_TIMINGS
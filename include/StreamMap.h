@@ -0,0 +1,25 @@
+#ifndef KALEIDOSCOPE_STREAM_MAP
+#define KALEIDOSCOPE_STREAM_MAP
+
+#include <cstddef>
+#include <string>
+
+#include "CompilerInstance.h"
+
+struct StreamMapOptions {
+    // File holding the rows. Empty or "-" reads them from stdin.
+    std::string inputFile;
+    // Rows are argCount raw doubles in host byte order instead of lines of comma separated values.
+    bool binary = false;
+    // Threads evaluating chunks of rows.
+    unsigned threads = 1;
+};
+
+// Evaluates map on every row of the input and writes one result per row to stdout, in the order
+// and the format of the input. The rows are cut into chunks that are parsed, evaluated and
+// formatted on several threads. Only a few chunks per thread are held at a time, and the pages of
+// a mapped file are dropped once their rows are written, so inputs larger than memory stream
+// through. Returns false after reporting the first malformed row or I/O error.
+bool StreamMap(MapFunction map, size_t argCount, const StreamMapOptions& options);
+
+#endif // KALEIDOSCOPE_STREAM_MAP
@@ -12,7 +12,7 @@ void NumberExprAST::PrettyPrint([[maybe_unused]] int indent, int titleIndent) co
 
 void VariableExprAST::PrettyPrint([[maybe_unused]] int indent, int titleIndent) const {
     std::cout << std::string(titleIndent, ' ');
-    std::cout << "VariableExprAST: " << name << std::endl;
+    std::cout << "VariableExprAST: " << name.str() << std::endl;
 }
 
 void BinaryExprAST::PrettyPrint(int indent, int titleIndent) const {
@@ -28,7 +28,7 @@ void BinaryExprAST::PrettyPrint(int indent, int titleIndent) const {
 
 void CallExprAST::PrettyPrint(int indent, int titleIndent) const {
     std::cout << std::string(indent, ' ');
-    std::cout << "CallExprAST: " << callee << std::endl;
+    std::cout << "CallExprAST: " << callee.str() << std::endl;
     for (int i = 0; i < args.size(); i++) {
         std::cout << std::string(indent + INDENT_SPACES, ' ');
         std::cout << "ARG[" << i << "]:" << std::endl;
@@ -47,22 +47,52 @@ void IfExprAST::PrettyPrint(int indent, int titleIndent) const {
     elseExp->PrettyPrint(indent + INDENT_SPACES, 0);
 }
 
+void ForExprAST::PrettyPrint(int indent, int titleIndent) const {
+    std::cout << std::string(titleIndent, ' ');
+    std::cout << "ForExprAST: " << varName.str() << std::endl;
+    std::cout << std::string(indent + INDENT_SPACES, ' ') << "start = ";
+    start->PrettyPrint(indent + INDENT_SPACES, 0);
+    std::cout << std::string(indent + INDENT_SPACES, ' ') << "end = ";
+    end->PrettyPrint(indent + INDENT_SPACES, 0);
+    if (step) {
+        std::cout << std::string(indent + INDENT_SPACES, ' ') << "step = ";
+        step->PrettyPrint(indent + INDENT_SPACES, 0);
+    }
+    std::cout << std::string(indent + INDENT_SPACES, ' ') << "body = ";
+    body->PrettyPrint(indent + INDENT_SPACES, 0);
+}
+
+void VarExprAST::PrettyPrint(int indent, int titleIndent) const {
+    std::cout << std::string(titleIndent, ' ');
+    std::cout << "VarExprAST:" << std::endl;
+    for (const Binding& binding : bindings) {
+        std::cout << std::string(indent + INDENT_SPACES, ' ') << binding.name.str() << " = ";
+        if (binding.init) {
+            binding.init->PrettyPrint(indent + INDENT_SPACES, 0);
+        } else {
+            std::cout << "0" << std::endl;
+        }
+    }
+    std::cout << std::string(indent + INDENT_SPACES, ' ') << "body = ";
+    body->PrettyPrint(indent + INDENT_SPACES, 0);
+}
+
 void PrototypeAST::PrettyPrint() const
 {
     std::cout << "PrototypeAST: ";
     std::string argsStr = "";
     for (auto s = args.begin(); s != args.end(); ++s) {
-        argsStr += *s;
+        argsStr += s->str();
         if (s != args.end() - 1) {
             argsStr += ", ";
         }
     }
-    std::cout << "def " << name << "(" << argsStr << ")" << std::endl;
+    std::cout << (isExtern ? "extern " : "def ") << name.str() << "(" << argsStr << ")" << std::endl;
 }
 
 void FunctionAST::PrettyPrint() const
 {
-    std::cout << "FunctionAST:" << std::endl;
+    std::cout << (memoized ? "FunctionAST (memo):" : "FunctionAST:") << std::endl;
     std::cout << std::string(INDENT_SPACES, ' ');
     std::cout << "prototype = ";
     prototype->PrettyPrint();
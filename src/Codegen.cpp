@@ -1,82 +1,255 @@
 #include "Codegen.h"
 
-#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
 
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Casting.h"
 #include "llvm/IR/Constant.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/Passes/StandardInstrumentations.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar/Reassociate.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar/SimplifyCFG.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "PhaseTimings.h"
 
 using namespace llvm;
 
-static std::unique_ptr<LLVMContext> theContext;
-static std::unique_ptr<Module> theModule;
-static std::unique_ptr<IRBuilder<>> builder;
-static std::map<std::string, Value *> namedValues;
+// Prototypes of every function handed to the JIT so far. Definitions live in modules of their
+// own, so later modules re-declare the functions they call from here. Generators on several
+// threads read it at once.
+static StringMap<const PrototypeAST*> functionProtos;
+static std::shared_mutex functionProtosMutex;
+
+void RegisterPrototype(const PrototypeAST* prototypeAST)
+{
+    std::unique_lock<std::shared_mutex> lock(functionProtosMutex);
+    functionProtos[prototypeAST->GetName()] = prototypeAST;
+}
+
+void UnregisterPrototype(StringRef name)
+{
+    std::unique_lock<std::shared_mutex> lock(functionProtosMutex);
+    functionProtos.erase(name);
+}
+
+const PrototypeAST* LookupPrototype(StringRef name)
+{
+    std::shared_lock<std::shared_mutex> lock(functionProtosMutex);
+    return functionProtos.lookup(name);
+}
+
+struct MathBuiltin {
+    llvm::StringLiteral name;
+    size_t argCount;
+    Intrinsic::ID id;
+};
+
+// Unlike the C functions, the intrinsics never set errno.
+static const MathBuiltin mathBuiltins[] = {
+    { "sqrt", 1, Intrinsic::sqrt },
+    { "sin", 1, Intrinsic::sin },
+    { "cos", 1, Intrinsic::cos },
+    { "exp", 1, Intrinsic::exp },
+    { "exp2", 1, Intrinsic::exp2 },
+    { "log", 1, Intrinsic::log },
+    { "log2", 1, Intrinsic::log2 },
+    { "log10", 1, Intrinsic::log10 },
+    { "fabs", 1, Intrinsic::fabs },
+    { "floor", 1, Intrinsic::floor },
+    { "ceil", 1, Intrinsic::ceil },
+    { "trunc", 1, Intrinsic::trunc },
+    { "round", 1, Intrinsic::round },
+    { "rint", 1, Intrinsic::rint },
+    { "nearbyint", 1, Intrinsic::nearbyint },
+    { "pow", 2, Intrinsic::pow },
+    { "copysign", 2, Intrinsic::copysign },
+    { "fmin", 2, Intrinsic::minnum },
+    { "fmax", 2, Intrinsic::maxnum },
+    { "fma", 3, Intrinsic::fma },
+};
+
+static Intrinsic::ID LookupMathBuiltin(const PrototypeAST* prototypeAST)
+{
+    if (!prototypeAST || !prototypeAST->IsExtern()) {
+        return Intrinsic::not_intrinsic;
+    }
+    for (const MathBuiltin& builtin : mathBuiltins) {
+        if (builtin.name == prototypeAST->GetName() && builtin.argCount == prototypeAST->GetArgs().size()) {
+            return builtin.id;
+        }
+    }
+    return Intrinsic::not_intrinsic;
+}
 
-std::unique_ptr<FunctionPassManager> theFPM;
-std::unique_ptr<LoopAnalysisManager> theLAM;
-std::unique_ptr<FunctionAnalysisManager> theFAM;
-std::unique_ptr<CGSCCAnalysisManager> theCGAM;
-std::unique_ptr<ModuleAnalysisManager> theMAM;
-std::unique_ptr<PassInstrumentationCallbacks> thePIC;
-std::unique_ptr<StandardInstrumentations> theSI;
+bool IsMathBuiltin(const PrototypeAST* prototypeAST)
+{
+    return LookupMathBuiltin(prototypeAST) != Intrinsic::not_intrinsic;
+}
+
+size_t ProfileCounterCount(const FunctionAST* functionAST)
+{
+    size_t count = 1;
+    auto visit = [&](const ExprAST* exprAST) {
+        if (isa<IfExprAST>(exprAST) || isa<ForExprAST>(exprAST)) {
+            count += 2;
+        }
+        return true;
+    };
+    VisitExprTree(functionAST->GetBody(), visit);
+    return count;
+}
+
+void CodeGenerator::InstrumentNextFunction(uint64_t* counters)
+{
+    profileCounters = counters;
+}
+
+void CodeGenerator::UseProfileForNextFunction(const uint64_t* counts)
+{
+    profileCounts = counts;
+}
+
+void CodeGenerator::MemoizeNextFunction(const MemoCache* cache)
+{
+    memoCache = cache;
+}
+
+// The counters are plain memory of the compiler, whose address is built into the code. Updates
+// are not atomic: a count lost to a race between threads does not matter to a profile.
+void CodeGenerator::IncrementProfileCounter(size_t index)
+{
+    if (!profileCounters) {
+        return;
+    }
+    Type* int64Ty = Type::getInt64Ty(*context);
+    Constant* address = ConstantExpr::getIntToPtr(
+        ConstantInt::get(int64Ty, reinterpret_cast<uintptr_t>(&profileCounters[index])),
+        PointerType::getUnqual(int64Ty));
+    Value* count = builder->CreateLoad(int64Ty, address, "profcount");
+    builder->CreateStore(builder->CreateAdd(count, ConstantInt::get(int64Ty, 1)), address);
+}
+
+// Weights of the two ways out of the condition counted at index, scaled down to 32 bits.
+MDNode* CodeGenerator::GetBranchWeights(size_t index)
+{
+    if (!profileCounts) {
+        return nullptr;
+    }
+    uint64_t taken = profileCounts[index];
+    uint64_t notTaken = profileCounts[index + 1];
+    uint64_t scale = std::max(taken, notTaken) / UINT32_MAX + 1;
+    return MDBuilder(*context).createBranchWeights(static_cast<uint32_t>(taken / scale),
+        static_cast<uint32_t>(notTaken / scale));
+}
 
-void InitializeModule()
+void CodeGenerator::EnableDebugInfo(std::string fileName)
 {
-    theContext = std::make_unique<LLVMContext>();
-    theModule = std::make_unique<Module>("Kale JIT", *theContext);
-    builder = std::make_unique<IRBuilder<>>(*theContext);
+    debugFile = std::move(fileName);
 }
 
-void InitializePassManagers()
+void CodeGenerator::SetCallSpecializer(CallSpecializer specializer)
 {
-    // theModule->setDataLayout();
-    theFPM = std::make_unique<FunctionPassManager>();
-    theLAM = std::make_unique<LoopAnalysisManager>();
-    theFAM = std::make_unique<FunctionAnalysisManager>();
-    theCGAM = std::make_unique<CGSCCAnalysisManager>();
-    theMAM = std::make_unique<ModuleAnalysisManager>();
-    thePIC = std::make_unique<PassInstrumentationCallbacks>();
-    theSI = std::make_unique<StandardInstrumentations>(*theContext, true);
+    callSpecializer = std::move(specializer);
+}
 
-    theSI->registerCallbacks(*thePIC, theFAM.get());
+void CodeGenerator::InitializeModule()
+{
+    // The module and the builders refer to the context, so they go first.
+    builder.reset();
+    debugBuilder.reset();
+    module.reset();
+    context = std::make_unique<LLVMContext>();
+    module = std::make_unique<Module>("Kale JIT", *context);
+    builder = std::make_unique<IRBuilder<>>(*context);
+    debugUnit = nullptr;
+    debugScope = nullptr;
+    if (!debugFile.empty()) {
+        module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+        module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+        debugBuilder = std::make_unique<DIBuilder>(*module);
+        DIFile* file = debugBuilder->createFile(sys::path::filename(debugFile), sys::path::parent_path(debugFile));
+        debugUnit = debugBuilder->createCompileUnit(dwarf::DW_LANG_C, file, "Kaleidoscope Compiler",
+            /*isOptimized=*/true, "", 0);
+    }
+}
 
-    theFPM->addPass(InstCombinePass());
-    theFPM->addPass(ReassociatePass());
-    theFPM->addPass(GVNPass());
-    theFPM->addPass(SimplifyCFGPass());
-    PassBuilder pb;
-    pb.registerModuleAnalyses(*theMAM);
-    pb.registerFunctionAnalyses(*theFAM);
-    pb.crossRegisterProxies(*theLAM, *theFAM, *theCGAM, *theMAM);
+void CodeGenerator::UseVectorLibrary(TargetLibraryInfoImpl::VectorLibrary library)
+{
+    vectorLibrary = library;
 }
 
+void CodeGenerator::InitializePassManagers(OptimizationLevel level, TargetMachine* targetMachine, bool debugLogging)
+{
+    // The outer analysis managers clear the inner ones through their proxies when destroyed, so
+    // the previous managers are torn down from the outside in.
+    mpm.reset();
+    mam.reset();
+    cgam.reset();
+    fam.reset();
+    lam.reset();
+    lam = std::make_unique<LoopAnalysisManager>();
+    fam = std::make_unique<FunctionAnalysisManager>();
+    cgam = std::make_unique<CGSCCAnalysisManager>();
+    mam = std::make_unique<ModuleAnalysisManager>();
+    pic = std::make_unique<PassInstrumentationCallbacks>();
+    si = std::make_unique<StandardInstrumentations>(*context, debugLogging);
+
+    si->registerCallbacks(*pic, fam.get());
+    if (PhaseTimingsEnabled()) {
+        RegisterPassTimers(*pic);
+    }
 
-std::unique_ptr<LLVMContext> GetContextUniquePtr()
+    // Vectorize from -O2 on, like clang does.
+    PipelineTuningOptions tuningOptions;
+    tuningOptions.LoopVectorization = level.getSpeedupLevel() > 1;
+    tuningOptions.SLPVectorization = level.getSpeedupLevel() > 1;
+    PassBuilder pb(targetMachine, tuningOptions, {}, pic.get());
+    // Registered ahead of the default, which then leaves it in place.
+    Triple triple(module->getTargetTriple());
+    TargetLibraryInfoImpl libraryInfo(triple);
+    libraryInfo.addVectorizableFunctionsFromVecLib(vectorLibrary, triple);
+    fam->registerPass([libraryInfo] { return TargetLibraryAnalysis(libraryInfo); });
+    pb.registerModuleAnalyses(*mam);
+    pb.registerCGSCCAnalyses(*cgam);
+    pb.registerFunctionAnalyses(*fam);
+    pb.registerLoopAnalyses(*lam);
+    pb.crossRegisterProxies(*lam, *fam, *cgam, *mam);
+    if (level == OptimizationLevel::O0) {
+        mpm = std::make_unique<ModulePassManager>(pb.buildO0DefaultPipeline(level));
+    } else {
+        mpm = std::make_unique<ModulePassManager>(pb.buildPerModuleDefaultPipeline(level));
+    }
+}
+
+std::unique_ptr<LLVMContext> CodeGenerator::GetContextUniquePtr()
 {
-    return std::move(theContext);
+    return std::move(context);
 }
 
-std::unique_ptr<Module> GetModuleUniquePtr()
+std::unique_ptr<Module> CodeGenerator::GetModuleUniquePtr()
 {
-    return std::move(theModule);
+    return std::move(module);
 }
 
-Module* GetModule()
+Module* CodeGenerator::GetModule()
 {
-    return theModule.get();
+    return module.get();
 }
 
 Value *LogErrorV(const std::string& str) {
@@ -84,26 +257,57 @@ Value *LogErrorV(const std::string& str) {
     return nullptr;
 }
 
-Value* GenerateCodeForExpr(const ExprAST* exprAST);
+Function* CodeGenerator::GetFunction(StringRef name)
+{
+    if (Function* f = module->getFunction(name)) {
+        return f;
+    }
+    // The function was emitted into another module, declare it in this one.
+    if (const PrototypeAST* prototypeAST = LookupPrototype(name)) {
+        return GenerateCodeForPrototype(prototypeAST);
+    }
+    return nullptr;
+}
 
-Value* GenerateCodeForNumberExpr(const NumberExprAST* numberExprAST)
+Value* CodeGenerator::GenerateCodeForNumberExpr(const NumberExprAST* numberExprAST)
 {
-    return ConstantFP::get(*theContext, APFloat(numberExprAST->GetValue()));
+    return ConstantFP::get(*context, APFloat(numberExprAST->GetValue()));
 }
 
-Value* GenerateCodeForVariableExpr(const VariableExprAST* variableExprAST)
+Value* CodeGenerator::GenerateCodeForVariableExpr(const VariableExprAST* variableExprAST)
 {
-    Value* v = namedValues[variableExprAST->GetName()];
-    if (!v) {
-        LogErrorV("Unknown variable name: " + variableExprAST->GetName());
+    AllocaInst* variable = namedValues.lookup(variableExprAST->GetName());
+    if (!variable) {
+        return LogErrorV("Unknown variable name: " + variableExprAST->GetName().str());
     }
-    return v;
+    return builder->CreateLoad(variable->getAllocatedType(), variable, variableExprAST->GetName());
 }
 
-Value* GenerateCodeForBinaryExpr(const BinaryExprAST* binaryExprAST)
+Value* CodeGenerator::GenerateCodeForAssignment(const BinaryExprAST* binaryExprAST)
 {
-    Value* LHS = GenerateCodeForExpr(binaryExprAST->LHS.get());
-    Value* RHS = GenerateCodeForExpr(binaryExprAST->RHS.get());
+    auto* target = dyn_cast<VariableExprAST>(binaryExprAST->LHS);
+    if (!target) {
+        return LogErrorV("Destination of '=' must be a variable");
+    }
+    Value* value = GenerateCodeForExpr(binaryExprAST->RHS);
+    if (!value) {
+        return nullptr;
+    }
+    AllocaInst* variable = namedValues.lookup(target->GetName());
+    if (!variable) {
+        return LogErrorV("Unknown variable name: " + target->GetName().str());
+    }
+    builder->CreateStore(value, variable);
+    return value;
+}
+
+Value* CodeGenerator::GenerateCodeForBinaryExpr(const BinaryExprAST* binaryExprAST)
+{
+    if (binaryExprAST->GetOp() == '=') {
+        return GenerateCodeForAssignment(binaryExprAST);
+    }
+    Value* LHS = GenerateCodeForExpr(binaryExprAST->LHS);
+    Value* RHS = GenerateCodeForExpr(binaryExprAST->RHS);
     if (!LHS || !RHS) {
         return nullptr;
     }
@@ -117,47 +321,89 @@ Value* GenerateCodeForBinaryExpr(const BinaryExprAST* binaryExprAST)
             return builder->CreateFMul(LHS, RHS, "multemp");
         case '/':
             return builder->CreateFDiv(LHS, RHS, "divtemp");
+        case '<':
+            // Comparisons give 1.0 or 0.0.
+            LHS = builder->CreateFCmpULT(LHS, RHS, "cmptemp");
+            return builder->CreateUIToFP(LHS, Type::getDoubleTy(*context), "booltemp");
         default:
             LogErrorV("Invalid binary operator: " + std::string(binaryExprAST->GetOp(), 1));
             return nullptr;
     }
 }
 
-Value* GenerateCodeForCallExpr(const CallExprAST* callExprAST)
+Value* CodeGenerator::GenerateCodeForCallExpr(const CallExprAST* callExprAST)
 {
-    Function* callee = theModule->getFunction(callExprAST->GetCallee());
+    Function* callee = GetFunction(callExprAST->GetCallee());
     if (!callee) {
-        return LogErrorV("Unknown function referenced: " + callExprAST->GetCallee());
+        return LogErrorV("Unknown function referenced: " + callExprAST->GetCallee().str());
     }
 
     if (callee->arg_size() != callExprAST->GetArgs().size()) {
         return LogErrorV("Incorrect # arguments passed");
     }
 
+    // Calls within the module can be inlined already, recursive calls included.
+    ArrayRef<ExprAST*> args = callExprAST->GetArgs();
+    bool hasConstants = std::any_of(args.begin(), args.end(), [](ExprAST* arg) { return isa<NumberExprAST>(arg); });
+    if (callSpecializer && hasConstants && callee->isDeclaration()) {
+        std::string name = callSpecializer(callExprAST->GetCallee(), args);
+        if (!name.empty()) {
+            return GenerateCodeForSpecializedCall(callExprAST, name);
+        }
+    }
+
     std::vector<Value*> argsV;
     for (unsigned int i = 0; i < callExprAST->GetArgs().size(); i++) {
-        argsV.push_back(GenerateCodeForExpr(callExprAST->GetArgs()[i].get()));
+        argsV.push_back(GenerateCodeForExpr(callExprAST->GetArgs()[i]));
         if (!argsV.back()) {
             return nullptr;
         }
     }
+    if (Intrinsic::ID id = LookupMathBuiltin(LookupPrototype(callExprAST->GetCallee()))) {
+        return builder->CreateIntrinsic(id, { Type::getDoubleTy(*context) }, argsV, nullptr, "calltemp");
+    }
     return builder->CreateCall(callee, argsV, "calltemp");
 }
 
-Value* GenerateCodeForIfExpr(const IfExprAST* ifExprAST) {
+// Calls name, passing only the arguments that are not literals.
+Value* CodeGenerator::GenerateCodeForSpecializedCall(const CallExprAST* callExprAST, StringRef name)
+{
+    std::vector<Value*> argsV;
+    for (ExprAST* arg : callExprAST->GetArgs()) {
+        if (isa<NumberExprAST>(arg)) {
+            continue;
+        }
+        argsV.push_back(GenerateCodeForExpr(arg));
+        if (!argsV.back()) {
+            return nullptr;
+        }
+    }
+    Function* callee = module->getFunction(name);
+    if (!callee) {
+        std::vector<Type*> argTypes(argsV.size(), Type::getDoubleTy(*context));
+        FunctionType* fType = FunctionType::get(Type::getDoubleTy(*context), argTypes, false);
+        callee = Function::Create(fType, Function::ExternalLinkage, name, module.get());
+    }
+    return builder->CreateCall(callee, argsV, "calltemp");
+}
+
+Value* CodeGenerator::GenerateCodeForIfExpr(const IfExprAST* ifExprAST) {
+    size_t counter = nextCounter;
+    nextCounter += 2;
     Value* conditionVal = GenerateCodeForExpr(ifExprAST->GetCondtionExpr());
     if (!conditionVal) {
         return nullptr;
     }
-    conditionVal = builder->CreateFCmpONE(conditionVal, ConstantFP::get(*theContext, APFloat(0.0)), "ifcond");
+    conditionVal = builder->CreateFCmpONE(conditionVal, ConstantFP::get(*context, APFloat(0.0)), "ifcond");
     Function* theFunction = builder->GetInsertBlock()->getParent();
-    BasicBlock *thenBB = BasicBlock::Create(*theContext, "then", theFunction);
-    BasicBlock *elseBB = BasicBlock::Create(*theContext, "else");
-    BasicBlock *mergeBB = BasicBlock::Create(*theContext, "ifcont");
-    builder->CreateCondBr(conditionVal, thenBB, elseBB);
+    BasicBlock *thenBB = BasicBlock::Create(*context, "then", theFunction);
+    BasicBlock *elseBB = BasicBlock::Create(*context, "else");
+    BasicBlock *mergeBB = BasicBlock::Create(*context, "ifcont");
+    builder->CreateCondBr(conditionVal, thenBB, elseBB, GetBranchWeights(counter));
 
     // Generate IR for then expression in the then branch.
     builder->SetInsertPoint(thenBB);
+    IncrementProfileCounter(counter);
     Value* thenVal = GenerateCodeForExpr(ifExprAST->GetThenExpr());
     if (!thenVal) {
         return nullptr;
@@ -170,6 +416,7 @@ Value* GenerateCodeForIfExpr(const IfExprAST* ifExprAST) {
     // Generate IR for else expression in the else branch.
     theFunction->insert(theFunction->end(), elseBB);
     builder->SetInsertPoint(elseBB);
+    IncrementProfileCounter(counter + 1);
     Value* elseVal = GenerateCodeForExpr(ifExprAST->GetElseExpr());
     if (!elseVal) {
         return nullptr;
@@ -181,42 +428,175 @@ Value* GenerateCodeForIfExpr(const IfExprAST* ifExprAST) {
 
     theFunction->insert(theFunction->end(), mergeBB);
     builder->SetInsertPoint(mergeBB);
-    PHINode* phi = builder->CreatePHI(Type::getDoubleTy(*theContext), 2, "iftmp");
+    PHINode* phi = builder->CreatePHI(Type::getDoubleTy(*context), 2, "iftmp");
     phi->addIncoming(thenVal, thenBB);
     phi->addIncoming(elseVal, elseBB);
     return phi;
 }
 
-Value* GenerateCodeForExpr(const ExprAST* exprAST)
+Value* CodeGenerator::GenerateCodeForForExpr(const ForExprAST* forExprAST)
 {
-    auto numberExprAST = dynamic_cast<const NumberExprAST*>(exprAST);
-    if (numberExprAST != nullptr) {
-        return GenerateCodeForNumberExpr(numberExprAST);
+    size_t counter = nextCounter;
+    nextCounter += 2;
+    Value* startVal = GenerateCodeForExpr(forExprAST->GetStartExpr());
+    if (!startVal) {
+        return nullptr;
     }
-    auto variableExprAST = dynamic_cast<const VariableExprAST*>(exprAST);
-    if (variableExprAST != nullptr) {
-        return GenerateCodeForVariableExpr(variableExprAST);
+    StringRef varName = forExprAST->GetVarName();
+    AllocaInst* variable = CreateVariable(varName, forExprAST->GetLine());
+    builder->CreateStore(startVal, variable);
+    // The loop variable shadows a variable of the same name until the loop ends.
+    AllocaInst* shadowed = namedValues.lookup(varName);
+    namedValues[varName] = variable;
+
+    // The condition is tested at the top, so the loop may not run at all. Loop rotation turns it
+    // into the guarded bottom-tested form the loop passes expect.
+    Function* theFunction = builder->GetInsertBlock()->getParent();
+    BasicBlock* conditionBB = BasicBlock::Create(*context, "loopcond", theFunction);
+    BasicBlock* loopBB = BasicBlock::Create(*context, "loop", theFunction);
+    BasicBlock* afterBB = BasicBlock::Create(*context, "afterloop", theFunction);
+    builder->CreateBr(conditionBB);
+
+    builder->SetInsertPoint(conditionBB);
+    Value* endVal = GenerateCodeForExpr(forExprAST->GetEndExpr());
+    if (!endVal) {
+        return nullptr;
     }
-    auto binaryExprAST = dynamic_cast<const BinaryExprAST*>(exprAST);
-    if (binaryExprAST != nullptr) {
-        return GenerateCodeForBinaryExpr(binaryExprAST);
+    endVal = builder->CreateFCmpONE(endVal, ConstantFP::get(*context, APFloat(0.0)), "loopcond");
+    builder->CreateCondBr(endVal, loopBB, afterBB, GetBranchWeights(counter));
+
+    builder->SetInsertPoint(loopBB);
+    IncrementProfileCounter(counter);
+    if (!GenerateCodeForExpr(forExprAST->GetBodyExpr())) {
+        return nullptr;
     }
-    auto callExprAST = dynamic_cast<const CallExprAST*>(exprAST);
-    if (callExprAST != nullptr) {
-        return GenerateCodeForCallExpr(callExprAST);
+    Value* stepVal = ConstantFP::get(*context, APFloat(1.0));
+    if (forExprAST->GetStepExpr()) {
+        stepVal = GenerateCodeForExpr(forExprAST->GetStepExpr());
+        if (!stepVal) {
+            return nullptr;
+        }
     }
-    auto ifExprAST = dynamic_cast<const IfExprAST*>(exprAST);
-    if (ifExprAST != nullptr) {
-        return GenerateCodeForIfExpr(ifExprAST);
+    Value* currentVal = builder->CreateLoad(variable->getAllocatedType(), variable, varName);
+    builder->CreateStore(builder->CreateFAdd(currentVal, stepVal, "nextvar"), variable);
+    builder->CreateBr(conditionBB);
+
+    builder->SetInsertPoint(afterBB);
+    IncrementProfileCounter(counter + 1);
+    if (shadowed) {
+        namedValues[varName] = shadowed;
+    } else {
+        namedValues.erase(varName);
     }
-    return nullptr;
+    return ConstantFP::get(*context, APFloat(0.0));
 }
 
-Function* GenerateCodeForPrototype(const PrototypeAST* prototypeAST)
+Value* CodeGenerator::GenerateCodeForVarExpr(const VarExprAST* varExprAST)
 {
-    std::vector<Type*> argTypes(prototypeAST->GetArgs().size(), Type::getDoubleTy(*theContext));
-    FunctionType* fType = FunctionType::get(Type::getDoubleTy(*theContext), argTypes, false);
-    Function* f = Function::Create(fType, Function::ExternalLinkage, prototypeAST->GetName(), theModule.get());
+    std::vector<std::pair<StringRef, AllocaInst*>> shadowed;
+    for (const VarExprAST::Binding& binding : varExprAST->GetBindings()) {
+        // The initializer runs before the variable is in scope, so "var a = a" reads the outer a.
+        Value* initVal = ConstantFP::get(*context, APFloat(0.0));
+        if (binding.init) {
+            initVal = GenerateCodeForExpr(binding.init);
+            if (!initVal) {
+                return nullptr;
+            }
+        }
+        AllocaInst* variable = CreateVariable(binding.name, varExprAST->GetLine());
+        builder->CreateStore(initVal, variable);
+        shadowed.emplace_back(binding.name, namedValues.lookup(binding.name));
+        namedValues[binding.name] = variable;
+    }
+
+    Value* bodyVal = GenerateCodeForExpr(varExprAST->GetBodyExpr());
+
+    for (auto iter = shadowed.rbegin(); iter != shadowed.rend(); ++iter) {
+        if (iter->second) {
+            namedValues[iter->first] = iter->second;
+        } else {
+            namedValues.erase(iter->first);
+        }
+    }
+    return bodyVal;
+}
+
+Value* CodeGenerator::GenerateCodeForExpr(const ExprAST* exprAST)
+{
+    // The instructions of an expression carry its line. Subexpressions put the enclosing line
+    // back, so an operator is not attributed to its last operand.
+    DebugLoc enclosingLocation = builder->getCurrentDebugLocation();
+    if (debugScope && exprAST->GetLine() != 0) {
+        builder->SetCurrentDebugLocation(DILocation::get(*context, exprAST->GetLine(), 0, debugScope));
+    }
+    Value* value = nullptr;
+    switch (exprAST->GetKind()) {
+        case ExprAST::Kind::Number:
+            value = GenerateCodeForNumberExpr(cast<NumberExprAST>(exprAST));
+            break;
+        case ExprAST::Kind::Variable:
+            value = GenerateCodeForVariableExpr(cast<VariableExprAST>(exprAST));
+            break;
+        case ExprAST::Kind::Binary:
+            value = GenerateCodeForBinaryExpr(cast<BinaryExprAST>(exprAST));
+            break;
+        case ExprAST::Kind::Call:
+            value = GenerateCodeForCallExpr(cast<CallExprAST>(exprAST));
+            break;
+        case ExprAST::Kind::If:
+            value = GenerateCodeForIfExpr(cast<IfExprAST>(exprAST));
+            break;
+        case ExprAST::Kind::For:
+            value = GenerateCodeForForExpr(cast<ForExprAST>(exprAST));
+            break;
+        case ExprAST::Kind::Var:
+            value = GenerateCodeForVarExpr(cast<VarExprAST>(exprAST));
+            break;
+    }
+    builder->SetCurrentDebugLocation(enclosingLocation);
+    return value;
+}
+
+// Describes f, whose parameters all are doubles, and starts attributing the instructions generated
+// to the function's line.
+void CodeGenerator::StartDebugFunction(Function* f, const PrototypeAST* prototypeAST)
+{
+    DIFile* file = debugUnit->getFile();
+    unsigned line = prototypeAST->GetLine();
+    DIType* doubleType = debugBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    SmallVector<Metadata*, 8> signature(f->arg_size() + 1, doubleType);
+    debugScope = debugBuilder->createFunction(file, f->getName(), StringRef(), file, line,
+        debugBuilder->createSubroutineType(debugBuilder->getOrCreateTypeArray(signature)), line,
+        DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    f->setSubprogram(debugScope);
+    builder->SetCurrentDebugLocation(DILocation::get(*context, line, 0, debugScope));
+}
+
+// Allocates the stack slot of a variable in the entry block, where mem2reg and SROA look for the
+// slots they promote. argNo is the 1-based position of a parameter, or 0 for a local variable.
+AllocaInst* CodeGenerator::CreateVariable(StringRef name, unsigned line, unsigned argNo)
+{
+    BasicBlock& entry = builder->GetInsertBlock()->getParent()->getEntryBlock();
+    IRBuilder<> entryBuilder(&entry, entry.begin());
+    AllocaInst* variable = entryBuilder.CreateAlloca(Type::getDoubleTy(*context), nullptr, name);
+    if (debugScope) {
+        DIFile* file = debugUnit->getFile();
+        DIType* doubleType = debugBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+        DILocalVariable* debugVariable = argNo
+            ? debugBuilder->createParameterVariable(debugScope, name, argNo, file, line, doubleType,
+                /*AlwaysPreserve=*/true)
+            : debugBuilder->createAutoVariable(debugScope, name, file, line, doubleType, /*AlwaysPreserve=*/true);
+        debugBuilder->insertDeclare(variable, debugVariable, debugBuilder->createExpression(),
+            DILocation::get(*context, line, 0, debugScope), builder->GetInsertBlock());
+    }
+    return variable;
+}
+
+Function* CodeGenerator::GenerateCodeForPrototype(const PrototypeAST* prototypeAST)
+{
+    std::vector<Type*> argTypes(prototypeAST->GetArgs().size(), Type::getDoubleTy(*context));
+    FunctionType* fType = FunctionType::get(Type::getDoubleTy(*context), argTypes, false);
+    Function* f = Function::Create(fType, Function::ExternalLinkage, prototypeAST->GetName(), module.get());
     unsigned int i = 0;
     for (auto& arg : f->args()) {
         arg.setName(prototypeAST->GetArgs()[i++]);
@@ -224,9 +604,9 @@ Function* GenerateCodeForPrototype(const PrototypeAST* prototypeAST)
     return f;
 }
 
-Function* GenerateCodeForFunction(const FunctionAST* functionAST)
+Function* CodeGenerator::GenerateCodeForFunction(const FunctionAST* functionAST)
 {
-    Function* f = theModule->getFunction(functionAST->GetPrototype()->GetName());
+    Function* f = module->getFunction(functionAST->GetPrototype()->GetName());
     if (!f) {
         f = GenerateCodeForPrototype(functionAST->GetPrototype());
     }
@@ -234,28 +614,260 @@ Function* GenerateCodeForFunction(const FunctionAST* functionAST)
         return nullptr;
     }
     if (!f->empty()) {
+        profileCounters = nullptr;
+        profileCounts = nullptr;
+        memoCache = nullptr;
         LogErrorV("Function cannot be redefined");
         return nullptr;
     }
 
-    BasicBlock* bb = BasicBlock::Create(*theContext, "entry", f);
+    BasicBlock* bb = BasicBlock::Create(*context, "entry", f);
     builder->SetInsertPoint(bb);
     namedValues.clear();
+    if (debugBuilder) {
+        StartDebugFunction(f, functionAST->GetPrototype());
+    }
     for (auto& arg : f->args()) {
-        namedValues[std::string(arg.getName())] = &arg;
+        AllocaInst* variable = CreateVariable(arg.getName(), functionAST->GetPrototype()->GetLine(),
+            arg.getArgNo() + 1);
+        builder->CreateStore(&arg, variable);
+        namedValues[arg.getName()] = variable;
+    }
+    nextCounter = 1;
+    IncrementProfileCounter(0);
+    if (profileCounts) {
+        f->setEntryCount(profileCounts[0]);
     }
 
-    if (Value* returnValue = GenerateCodeForExpr(functionAST->GetBody())) {
+    Value* returnValue = GenerateCodeForExpr(functionAST->GetBody());
+    if (returnValue) {
         builder->CreateRet(returnValue);
+    }
+    profileCounters = nullptr;
+    profileCounts = nullptr;
+    const MemoCache* cache = memoCache;
+    memoCache = nullptr;
+    debugScope = nullptr;
+    builder->SetCurrentDebugLocation(DebugLoc());
+    if (returnValue) {
         verifyFunction(*f);
-        return f;
+        return cache ? GenerateCodeForMemoizedEntry(f, *cache) : f;
+    }
+    // Calls generated earlier into the same module keep referring to the function, so it stays
+    // behind as a declaration.
+    f->deleteBody();
+    if (f->use_empty()) {
+        f->eraseFromParent();
     }
-    f->eraseFromParent();
     return nullptr;
 }
 
-Function* RunOptmizationPasses(Function* f)
+// The entry takes the place of body, calls from the module included, so recursive calls go through
+// the cache too. body is left as "name.body", called on misses only.
+Function* CodeGenerator::GenerateCodeForMemoizedEntry(Function* body, const MemoCache& cache)
+{
+    Function* f = Function::Create(body->getFunctionType(), Function::ExternalLinkage, "", module.get());
+    f->takeName(body);
+    body->replaceAllUsesWith(f);
+    body->setName(f->getName() + ".body");
+    body->setLinkage(Function::InternalLinkage);
+    // Keeps the lookup small, and the body's debug info to itself.
+    body->addFnAttr(Attribute::NoInline);
+
+    Type* int64Ty = Type::getInt64Ty(*context);
+    Type* doubleTy = Type::getDoubleTy(*context);
+    auto getInt64 = [&](uint64_t value) { return ConstantInt::get(int64Ty, value); };
+    auto getAddress = [&](const uint64_t* p) {
+        return ConstantExpr::getIntToPtr(getInt64(reinterpret_cast<uintptr_t>(p)), PointerType::getUnqual(int64Ty));
+    };
+    auto createAtomicLoad = [&](Value* address, AtomicOrdering ordering) {
+        LoadInst* load = builder->CreateAlignedLoad(int64Ty, address, Align(8));
+        load->setAtomic(ordering);
+        return load;
+    };
+    auto createAtomicStore = [&](Value* value, Value* address, AtomicOrdering ordering) {
+        builder->CreateAlignedStore(value, address, Align(8))->setAtomic(ordering);
+    };
+    unsigned argCount = f->arg_size();
+    BasicBlock* entryBB = BasicBlock::Create(*context, "entry", f);
+    BasicBlock* compareBB = BasicBlock::Create(*context, "compare", f);
+    BasicBlock* hitBB = BasicBlock::Create(*context, "hit", f);
+    BasicBlock* missBB = BasicBlock::Create(*context, "miss", f);
+    BasicBlock* storeBB = BasicBlock::Create(*context, "store", f);
+    BasicBlock* returnBB = BasicBlock::Create(*context, "return", f);
+
+    // Arguments are compared by their bits and mixed into the slot index.
+    builder->SetInsertPoint(entryBB);
+    std::vector<Value*> args, keys;
+    Value* hash = getInt64(0);
+    for (auto& arg : f->args()) {
+        arg.setName(body->getArg(arg.getArgNo())->getName());
+        args.push_back(&arg);
+        keys.push_back(builder->CreateBitCast(&arg, int64Ty));
+        hash = builder->CreateXor(hash, keys.back());
+        for (uint64_t multiplier : { 0xff51afd7ed558ccdull, 0xc4ceb9fe1a85ec53ull }) {
+            hash = builder->CreateMul(builder->CreateXor(hash, builder->CreateLShr(hash, 33)), getInt64(multiplier));
+        }
+        hash = builder->CreateXor(hash, builder->CreateLShr(hash, 33));
+    }
+    Value* index = builder->CreateAnd(hash, getInt64(cache.capacity - 1));
+    Value* slot = builder->CreateGEP(int64Ty, getAddress(cache.slots),
+        builder->CreateMul(index, getInt64(argCount + 2)), "slot");
+    Value* sequence = createAtomicLoad(slot, AtomicOrdering::Acquire);
+    Value* written = builder->CreateAnd(builder->CreateICmpNE(sequence, getInt64(0)),
+        builder->CreateICmpEQ(builder->CreateAnd(sequence, getInt64(1)), getInt64(0)));
+    builder->CreateCondBr(written, compareBB, missBB);
+
+    builder->SetInsertPoint(compareBB);
+    Value* match = builder->getTrue();
+    for (unsigned i = 0; i < argCount; i++) {
+        Value* key = createAtomicLoad(builder->CreateConstGEP1_64(int64Ty, slot, i + 1), AtomicOrdering::Unordered);
+        match = builder->CreateAnd(match, builder->CreateICmpEQ(key, keys[i]));
+    }
+    Value* cached = createAtomicLoad(builder->CreateConstGEP1_64(int64Ty, slot, argCount + 1),
+        AtomicOrdering::Unordered);
+    builder->CreateFence(AtomicOrdering::Acquire);
+    Value* unchanged = builder->CreateICmpEQ(createAtomicLoad(slot, AtomicOrdering::Monotonic), sequence);
+    builder->CreateCondBr(builder->CreateAnd(match, unchanged), hitBB, missBB);
+
+    builder->SetInsertPoint(hitBB);
+    builder->CreateAtomicRMW(AtomicRMWInst::Add, getAddress(&cache.counters[0]), getInt64(1), Align(8),
+        AtomicOrdering::Monotonic);
+    builder->CreateRet(builder->CreateBitCast(cached, doubleTy));
+
+    // The slot is claimed by making its sequence number odd, which fails if another call is
+    // writing it, or with the keep policy if it is taken.
+    builder->SetInsertPoint(missBB);
+    builder->CreateAtomicRMW(AtomicRMWInst::Add, getAddress(&cache.counters[1]), getInt64(1), Align(8),
+        AtomicOrdering::Monotonic);
+    Value* result = builder->CreateCall(body, args, "result");
+    Value* expected = cache.replace
+        ? builder->CreateAnd(createAtomicLoad(slot, AtomicOrdering::Monotonic), getInt64(~uint64_t(1)))
+        : getInt64(0);
+    Value* claim = builder->CreateAtomicCmpXchg(slot, expected, builder->CreateAdd(expected, getInt64(1)), Align(8),
+        AtomicOrdering::Acquire, AtomicOrdering::Monotonic);
+    builder->CreateCondBr(builder->CreateExtractValue(claim, 1), storeBB, returnBB);
+
+    builder->SetInsertPoint(storeBB);
+    for (unsigned i = 0; i < argCount; i++) {
+        createAtomicStore(keys[i], builder->CreateConstGEP1_64(int64Ty, slot, i + 1), AtomicOrdering::Unordered);
+    }
+    createAtomicStore(builder->CreateBitCast(result, int64Ty), builder->CreateConstGEP1_64(int64Ty, slot, argCount + 1),
+        AtomicOrdering::Unordered);
+    createAtomicStore(builder->CreateAdd(expected, getInt64(2)), slot, AtomicOrdering::Release);
+    builder->CreateBr(returnBB);
+
+    builder->SetInsertPoint(returnBB);
+    builder->CreateRet(result);
+    verifyFunction(*f);
+    return f;
+}
+
+Function* CodeGenerator::GenerateCodeForSpecialization(Function* generic, ArrayRef<std::optional<double>> constants,
+    StringRef name)
 {
-    theFPM->run(*f, *theFAM);
+    size_t paramCount = std::count_if(constants.begin(), constants.end(),
+        [](const std::optional<double>& constant) { return !constant; });
+    std::vector<Type*> argTypes(paramCount, Type::getDoubleTy(*context));
+    FunctionType* fType = FunctionType::get(Type::getDoubleTy(*context), argTypes, false);
+    Function* f = Function::Create(fType, Function::ExternalLinkage, name, module.get());
+    // Like the kernel of a map wrapper, the generic body is only there to be inlined.
+    generic->setLinkage(Function::InternalLinkage);
+    generic->addFnAttr(Attribute::AlwaysInline);
+    stripDebugInfo(*generic);
+
+    builder->SetInsertPoint(BasicBlock::Create(*context, "entry", f));
+    std::vector<Value*> argsV;
+    auto param = f->arg_begin();
+    for (size_t i = 0; i < constants.size(); i++) {
+        if (constants[i]) {
+            argsV.push_back(ConstantFP::get(*context, APFloat(*constants[i])));
+        } else {
+            param->setName(generic->getArg(i)->getName());
+            argsV.push_back(&*param++);
+        }
+    }
+    builder->CreateRet(builder->CreateCall(generic, argsV, "calltemp"));
+    verifyFunction(*f);
     return f;
 }
+
+Function* CodeGenerator::GenerateCodeForMapWrapper(const FunctionAST* functionAST, StringRef wrapperName)
+{
+    Function* kernel = GenerateCodeForFunction(functionAST);
+    if (!kernel) {
+        return nullptr;
+    }
+    // Only the loop calls this copy, so the inliner folds it in and drops it. The loop has no debug
+    // info, and inlined instructions must not refer to a subprogram of another function.
+    kernel->setLinkage(Function::InternalLinkage);
+    stripDebugInfo(*kernel);
+    unsigned argCount = kernel->arg_size();
+    Type* doubleTy = Type::getDoubleTy(*context);
+    Type* int64Ty = Type::getInt64Ty(*context);
+    PointerType* arrayTy = PointerType::getUnqual(doubleTy);
+
+    // void loop(const double* noalias in0, ..., double* noalias out, int64_t count)
+    std::vector<Type*> loopArgTypes(argCount + 1, arrayTy);
+    loopArgTypes.push_back(int64Ty);
+    Function* loop = Function::Create(FunctionType::get(Type::getVoidTy(*context), loopArgTypes, false),
+        Function::InternalLinkage, wrapperName + ".loop", module.get());
+    for (unsigned i = 0; i <= argCount; i++) {
+        loop->addParamAttr(i, Attribute::NoAlias);
+        loop->addParamAttr(i, Attribute::NoCapture);
+        if (i < argCount) {
+            loop->addParamAttr(i, Attribute::ReadOnly);
+        }
+    }
+    Value* count = loop->getArg(argCount + 1);
+    BasicBlock* entryBB = BasicBlock::Create(*context, "entry", loop);
+    BasicBlock* bodyBB = BasicBlock::Create(*context, "body", loop);
+    BasicBlock* exitBB = BasicBlock::Create(*context, "exit", loop);
+    builder->SetInsertPoint(entryBB);
+    builder->CreateCondBr(builder->CreateICmpSGT(count, ConstantInt::get(int64Ty, 0)), bodyBB, exitBB);
+    builder->SetInsertPoint(bodyBB);
+    PHINode* index = builder->CreatePHI(int64Ty, 2, "i");
+    index->addIncoming(ConstantInt::get(int64Ty, 0), entryBB);
+    std::vector<Value*> args;
+    for (unsigned i = 0; i < argCount; i++) {
+        Value* element = builder->CreateGEP(doubleTy, loop->getArg(i), index);
+        args.push_back(builder->CreateLoad(doubleTy, element));
+    }
+    Value* result = builder->CreateCall(kernel, args);
+    builder->CreateStore(result, builder->CreateGEP(doubleTy, loop->getArg(argCount), index));
+    Value* next = builder->CreateAdd(index, ConstantInt::get(int64Ty, 1), "next", /*HasNUW=*/true, /*HasNSW=*/true);
+    index->addIncoming(next, bodyBB);
+    builder->CreateCondBr(builder->CreateICmpEQ(next, count), exitBB, bodyBB);
+    builder->SetInsertPoint(exitBB);
+    builder->CreateRetVoid();
+
+    // The entry point takes the input arrays as an array, so callers need not know the arity.
+    PointerType* inputsTy = PointerType::getUnqual(arrayTy);
+    Function* wrapper = Function::Create(
+        FunctionType::get(Type::getVoidTy(*context), { inputsTy, arrayTy, int64Ty }, false),
+        Function::ExternalLinkage, wrapperName, module.get());
+    builder->SetInsertPoint(BasicBlock::Create(*context, "entry", wrapper));
+    std::vector<Value*> loopArgs;
+    for (unsigned i = 0; i < argCount; i++) {
+        Value* slot = builder->CreateGEP(arrayTy, wrapper->getArg(0), builder->getInt64(i));
+        loopArgs.push_back(builder->CreateLoad(arrayTy, slot));
+    }
+    loopArgs.push_back(wrapper->getArg(1));
+    loopArgs.push_back(wrapper->getArg(2));
+    builder->CreateCall(loop, loopArgs);
+    builder->CreateRetVoid();
+    verifyFunction(*loop);
+    verifyFunction(*wrapper);
+    return wrapper;
+}
+
+Module* CodeGenerator::RunOptmizationPasses()
+{
+    if (debugBuilder) {
+        debugBuilder->finalize();
+    }
+    mpm->run(*module, *mam);
+    // Cached analyses refer to the IR, which the JIT frees once the module is compiled.
+    mam->clear();
+    return module.get();
+}
@@ -1,156 +1,1719 @@
 #include "CompilerInstance.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <iostream>
-#include <variant>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <set>
+#include <thread>
 
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Program.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Target/TargetMachine.h"
 #include "Kaleidoscope-JIT.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
 
 #include "AST.h"
 #include "Codegen.h"
+#include "Interpreter.h"
 #include "Lexer.h"
+#include "ObjectCache.h"
+#include "PerfMap.h"
+#include "PhaseTimings.h"
+#include "StreamMap.h"
 
 using namespace llvm;
 using namespace llvm::orc;
 
+// Declared before the JIT, which compiles through them until it is destroyed.
+static std::unique_ptr<DiskObjectCache> theObjectCache;
+static std::unique_ptr<PerfMapListener> thePerfMapListener;
 static std::unique_ptr<KaleidoscopeJIT> theJIT;
 static ExitOnError ExitOnErr;
-static std::vector<std::variant<std::unique_ptr<PrototypeAST>, std::unique_ptr<FunctionAST>>> functions;
+static CompilerOptions compilerOptions;
+// Arenas holding the AST of every definition and extern of the session. Later modules only see a
+// function through its registered prototype, so these live as long as the session.
+static std::vector<std::unique_ptr<ASTContext>> astContexts;
 
-void InitializeJIT()
+// Every definition is compiled under a versioned name, e.g. "foo.2". Callers in other modules bind
+// to a stub named "foo" that is pointed at the latest version, so redefining a function only
+// compiles the new body. Old versions are never removed, since code compiled against them may
+// still be running.
+struct DefinedFunction {
+    size_t argCount = 0;
+    unsigned version = 0;
+    // Whether the stub exists. A definition that failed to compile can get one without a version.
+    bool stubbed = false;
+    std::vector<ResourceTrackerSP> trackers;
+    // The latest definition, which map wrappers are generated from.
+    const FunctionAST* definition = nullptr;
+    // Map wrapper of the definition of version mapVersion, generated on first use.
+    unsigned mapVersion = 0;
+    MapFunction mapFunction = nullptr;
+    // With tiered execution, functions run in the interpreter until it has called them
+    // compilerOptions.tierThreshold times. Set while the latest definition is not compiled.
+    bool interpreted = false;
+    uint64_t interpretedCalls = 0;
+    // Address of the stub, for calls from the interpreter.
+    void* stubAddress = nullptr;
+};
+static std::map<std::string, DefinedFunction> definedFunctions;
+// Definitions waiting to be compiled. Running a file batches consecutive definitions, which are
+// spread over compilerOptions.compileThreads modules generated and optimized in parallel. The REPL
+// compiles each one right away.
+static std::vector<const FunctionAST*> pendingDefinitions;
+static bool groupDefinitions = false;
+// Functions a file defines more than once. They are compiled on their own, so every caller goes
+// through the stub and sees each redefinition, just like in the REPL.
+static std::set<std::string> redefinedFunctions;
+// Set when an item fails to parse or compile.
+static bool itemFailed = false;
+// Generates top-level expressions, externs and ahead of time compiled files on the main thread.
+static CodeGenerator theCodeGenerator;
+// Gives the optimizer the cost models of the target the JIT compiles for.
+static std::unique_ptr<TargetMachine> theTargetMachine;
+// Phase times of the item being handled, while timing is on.
+static PhaseTimes itemTimes;
+// Given to every module's pipeline.
+static TargetLibraryInfoImpl::VectorLibrary vectorLibrary = TargetLibraryInfoImpl::NoLibrary;
+
+static OptimizationLevel GetOptimizationLevel(unsigned level)
+{
+    switch (level) {
+        case 0:
+            return OptimizationLevel::O0;
+        case 1:
+            return OptimizationLevel::O1;
+        case 2:
+            return OptimizationLevel::O2;
+        default:
+            return OptimizationLevel::O3;
+    }
+}
+
+static CodeGenOpt::Level GetCodeGenOptLevel(unsigned level)
+{
+    switch (level) {
+        case 0:
+            return CodeGenOpt::None;
+        case 1:
+            return CodeGenOpt::Less;
+        case 2:
+            return CodeGenOpt::Default;
+        default:
+            return CodeGenOpt::Aggressive;
+    }
+}
+
+// Parses options.vectorLibrary into vectorLibrary. Returns false on an unknown name.
+static bool SelectVectorLibrary(const CompilerOptions& options)
+{
+    static const std::pair<StringRef, TargetLibraryInfoImpl::VectorLibrary> libraries[] = {
+        { "", TargetLibraryInfoImpl::NoLibrary },
+        { "libmvec", TargetLibraryInfoImpl::LIBMVEC_X86 },
+        { "SVML", TargetLibraryInfoImpl::SVML },
+        { "MASSV", TargetLibraryInfoImpl::MASSV },
+        { "Accelerate", TargetLibraryInfoImpl::Accelerate },
+        { "Darwin_libsystem_m", TargetLibraryInfoImpl::DarwinLibSystemM },
+    };
+    for (auto& [name, library] : libraries) {
+        if (name == options.vectorLibrary) {
+            vectorLibrary = library;
+            return true;
+        }
+    }
+    fprintf(stderr, "Error: Unknown vector library: %s\n", options.vectorLibrary.c_str());
+    return false;
+}
+
+// Shared library holding the functions of the vector library, if it is not part of the process.
+static std::string GetVectorLibraryPath(const CompilerOptions& options)
+{
+    if (!options.vectorLibraryPath.empty()) {
+        return options.vectorLibraryPath;
+    }
+    return vectorLibrary == TargetLibraryInfoImpl::LIBMVEC_X86 ? "libmvec.so.1" : "";
+}
+
+// Everything besides the IR that changes the code the JIT generates. The JIT targets the host CPU
+// with all of its features.
+static std::string GetCacheConfiguration(const CompilerOptions& options)
+{
+    std::string configuration = sys::getProcessTriple() + ";" + sys::getHostCPUName().str() + ";O" +
+        std::to_string(options.optLevel) + ";veclib=" + options.vectorLibrary;
+    StringMap<bool> features;
+    if (sys::getHostCPUFeatures(features)) {
+        std::vector<std::string> enabled;
+        for (auto& feature : features) {
+            if (feature.getValue()) {
+                enabled.push_back(feature.getKey().str());
+            }
+        }
+        std::sort(enabled.begin(), enabled.end());
+        for (auto& feature : enabled) {
+            configuration += ";+" + feature;
+        }
+    }
+    return configuration;
+}
+
+void InitializeJIT(const CompilerOptions& options)
 {
     LLVMInitializeNativeTarget();
     LLVMInitializeNativeAsmPrinter();
     LLVMInitializeNativeAsmParser();
-    theJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    if (!options.cacheDir.empty()) {
+        if (auto error = sys::fs::create_directories(options.cacheDir)) {
+            fprintf(stderr, "Error: Cannot create cache directory %s: %s\n", options.cacheDir.c_str(),
+                error.message().c_str());
+        } else {
+            theObjectCache = std::make_unique<DiskObjectCache>(options.cacheDir, GetCacheConfiguration(options));
+        }
+    }
+    theJIT = ExitOnErr(KaleidoscopeJIT::Create(options.lazy, GetCodeGenOptLevel(options.optLevel),
+        theObjectCache.get()));
+    if (options.perfMap) {
+        thePerfMapListener = PerfMapListener::Create();
+        if (thePerfMapListener) {
+            theJIT->registerJITEventListener(*thePerfMapListener);
+        }
+        // Null unless LLVM is built with LLVM_USE_PERF.
+        if (JITEventListener* perfListener = JITEventListener::createPerfJITEventListener()) {
+            theJIT->registerJITEventListener(*perfListener);
+        }
+    }
+    if (options.gdbRegistration) {
+        theJIT->registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+    }
+    JITTargetMachineBuilder jtmb = theJIT->getTargetMachineBuilder();
+    theTargetMachine = ExitOnErr(jtmb.createTargetMachine());
+}
+
+// File named by debug info, absolute so tools find it from any directory.
+static std::string GetDebugSourceFile()
+{
+    if (compilerOptions.inputFile.empty()) {
+        return "<stdin>";
+    }
+    SmallString<256> path(compilerOptions.inputFile);
+    sys::fs::make_absolute(path);
+    return path.str().str();
+}
+
+// Cache of a definition made with "memo def". Every definition gets a cache of its own, which the
+// code compiled from it shares, map wrappers and reoptimized versions included. Replaced versions
+// may still be running, so caches are never freed.
+struct MemoizedFunction {
+    std::unique_ptr<uint64_t[]> slots;
+    std::unique_ptr<uint64_t[]> counters;
+    MemoCache cache;
+    // Functions the definition calls, directly or not. Redefining one makes the results stale.
+    std::set<std::string> callees;
+};
+// Null for memoized definitions that are not pure, which are compiled without a cache. Compile
+// jobs only read it.
+static std::map<const FunctionAST*, std::unique_ptr<MemoizedFunction>> memoizedFunctions;
+// Caches replaced because a callee was redefined.
+static std::vector<std::unique_ptr<MemoizedFunction>> staleMemoizedFunctions;
+
+// Latest definition of name, pending ones included. Null for externs.
+static const FunctionAST* FindLatestDefinition(const std::string& name)
+{
+    for (size_t i = pendingDefinitions.size(); i > 0; i--) {
+        if (pendingDefinitions[i - 1]->GetPrototype()->GetName() == name) {
+            return pendingDefinitions[i - 1];
+        }
+    }
+    auto iter = definedFunctions.find(name);
+    return iter != definedFunctions.end() ? iter->second.definition : nullptr;
+}
+
+// Whether def computes its result from its arguments alone: it calls no extern but math builtins,
+// directly or through the current definitions of the functions it calls. Adds the functions checked
+// to visited.
+static bool IsPure(const FunctionAST* def, std::set<std::string>& visited)
+{
+    SmallVector<StringRef, 8> callees;
+    CollectCallees(def, callees);
+    for (StringRef callee : callees) {
+        if (!visited.insert(callee.str()).second) {
+            continue;
+        }
+        const FunctionAST* calleeDef = FindLatestDefinition(callee.str());
+        if (!calleeDef && IsMathBuiltin(LookupPrototype(callee))) {
+            continue;
+        }
+        if (!calleeDef || !IsPure(calleeDef, visited)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sets up the cache of a pending memoized definition the first time it is compiled, and again
+// after QueueStaleMemoizedFunctions() drops it, checking its purity each time.
+static void CreateMemoCache(const FunctionAST* def)
+{
+    if (memoizedFunctions.count(def) != 0) {
+        return;
+    }
+    std::string name = def->GetPrototype()->GetName().str();
+    std::set<std::string> visited = { name };
+    if (!IsPure(def, visited)) {
+        fprintf(stderr, "Warning: %s calls an extern, so it is not memoized\n", name.c_str());
+        memoizedFunctions[def] = nullptr;
+        return;
+    }
+    auto memoized = std::make_unique<MemoizedFunction>();
+    memoized->cache.capacity = PowerOf2Ceil(std::max<size_t>(compilerOptions.memoCapacity, 1));
+    memoized->cache.replace = compilerOptions.memoReplace;
+    memoized->slots = std::make_unique<uint64_t[]>(memoized->cache.capacity * (def->GetPrototype()->GetArgs().size() + 2));
+    memoized->counters = std::make_unique<uint64_t[]>(2);
+    memoized->cache.slots = memoized->slots.get();
+    memoized->cache.counters = memoized->counters.get();
+    visited.erase(name);
+    memoized->callees = std::move(visited);
+    memoizedFunctions[def] = std::move(memoized);
+}
+
+// Queues the memoized functions calling a pending redefinition, so they are compiled again with
+// an empty cache and reach the new callee at the same time. Code compiled before keeps the old
+// cache.
+static void QueueStaleMemoizedFunctions()
+{
+    if (memoizedFunctions.empty()) {
+        return;
+    }
+    // Promoted functions are compiled from the definition they already have.
+    std::set<std::string> redefined;
+    for (auto def : pendingDefinitions) {
+        std::string name = def->GetPrototype()->GetName().str();
+        auto iter = definedFunctions.find(name);
+        if (iter == definedFunctions.end() || iter->second.definition != def) {
+            redefined.insert(name);
+        }
+    }
+    for (auto& [name, record] : definedFunctions) {
+        if (redefined.count(name) != 0 || !record.definition) {
+            continue;
+        }
+        auto iter = memoizedFunctions.find(record.definition);
+        if (iter == memoizedFunctions.end() || !iter->second) {
+            continue;
+        }
+        auto& callees = iter->second->callees;
+        if (std::any_of(callees.begin(), callees.end(), [&](const std::string& callee) {
+                return redefined.count(callee) != 0;
+            })) {
+            staleMemoizedFunctions.push_back(std::move(iter->second));
+            memoizedFunctions.erase(iter);
+            pendingDefinitions.push_back(record.definition);
+        }
+    }
+}
+
+static const MemoCache* FindMemoCache(const FunctionAST* def)
+{
+    auto iter = memoizedFunctions.find(def);
+    return iter != memoizedFunctions.end() && iter->second ? &iter->second->cache : nullptr;
+}
+
+// With specialization, calls passing literal arguments to a compiled function go to a copy of it
+// folded for those values, e.g. "poly.spec.1" for poly(x, 1, 2, 3). Copies are reached through
+// stubs like any function, and are compiled again from the callee's latest definition when it is
+// redefined. The cache holds compilerOptions.specializationCacheSize copies, and calls matching
+// none of them once it is full go to the callee. Entries are never evicted, as compiled callers
+// stay bound to their stubs.
+struct Specialization {
+    std::string callee;
+    // The value of each literal argument, by position.
+    std::vector<std::optional<double>> constants;
+    std::string name;
+    // Whether the stub exists, so code can call it.
+    bool stubbed = false;
+    // Version of the callee the stub points at, 0 until it is compiled.
+    unsigned calleeVersion = 0;
+};
+// Compile jobs and the reoptimizer look up specializations from their own threads.
+static std::mutex specializationsMutex;
+static std::map<std::string, std::unique_ptr<Specialization>> specializations;
+// Functions compiled so far, which are the ones calls can be specialized for.
+static std::set<std::string> specializableFunctions;
+
+// Returns the name of the specialization of callee for the literals among args, or an empty
+// string. New ones are only added if create is set, and are called through stubs that do not
+// exist until GenerateSpecializations runs.
+static std::string SpecializeCall(StringRef callee, ArrayRef<ExprAST*> args, bool create)
+{
+    std::string key = callee.str();
+    for (ExprAST* arg : args) {
+        auto numberExprAST = dyn_cast<NumberExprAST>(arg);
+        key += numberExprAST ? "," + utohexstr(DoubleToBits(numberExprAST->GetValue())) : ",_";
+    }
+    std::lock_guard<std::mutex> lock(specializationsMutex);
+    auto iter = specializations.find(key);
+    if (iter != specializations.end()) {
+        return create || iter->second->stubbed ? iter->second->name : "";
+    }
+    if (!create || specializableFunctions.count(callee.str()) == 0 ||
+        specializations.size() >= compilerOptions.specializationCacheSize) {
+        return "";
+    }
+    auto specialization = std::make_unique<Specialization>();
+    specialization->callee = callee.str();
+    for (ExprAST* arg : args) {
+        auto numberExprAST = dyn_cast<NumberExprAST>(arg);
+        specialization->constants.emplace_back();
+        if (numberExprAST) {
+            specialization->constants.back() = numberExprAST->GetValue();
+        }
+    }
+    specialization->name = specialization->callee + ".spec." + std::to_string(specializations.size() + 1);
+    std::string name = specialization->name;
+    specializations.emplace(key, std::move(specialization));
+    return name;
+}
+
+// Makes the calls generator generates go to specializations while they are on. Top-level
+// expressions run once, so they are not worth specializing for.
+static void EnableSpecialization(CodeGenerator& generator, bool create)
+{
+    if (compilerOptions.specializationCacheSize != 0) {
+        generator.SetCallSpecializer([create](StringRef callee, ArrayRef<ExprAST*> args) {
+            return SpecializeCall(callee, args, create);
+        });
+    }
+}
+
+// Starts a fresh module in the generator. The pass managers hold on to the previous context and
+// cache analyses by function address, so they are rebuilt as well to give every module the same
+// pipeline.
+static void StartModule(CodeGenerator& generator, TargetMachine* targetMachine, OptimizationLevel level)
+{
+    if (compilerOptions.debugInfo) {
+        generator.EnableDebugInfo(GetDebugSourceFile());
+    }
+    generator.InitializeModule();
+    generator.GetModule()->setDataLayout(targetMachine->createDataLayout());
+    generator.GetModule()->setTargetTriple(targetMachine->getTargetTriple().str());
+    generator.UseVectorLibrary(vectorLibrary);
+    generator.InitializePassManagers(level, targetMachine, compilerOptions.debugPassManager);
+}
+
+static void StartNextModule()
+{
+    StartModule(theCodeGenerator, theTargetMachine.get(), GetOptimizationLevel(compilerOptions.optLevel));
+}
+
+static Expected<ResourceTrackerSP> AddModuleToJIT(CodeGenerator& generator, bool eager = false)
+{
+    auto rt = theJIT->getMainJITDylib().createResourceTracker();
+    auto module = generator.GetModuleUniquePtr();
+    auto context = generator.GetContextUniquePtr();
+    auto tsm = ThreadSafeModule(std::move(module), std::move(context));
+    if (Error error = eager ? theJIT->addEagerModule(std::move(tsm), rt) : theJIT->addModule(std::move(tsm), rt)) {
+        return std::move(error);
+    }
+    return rt;
+}
+
+// Fails the item being handled on an error of the JIT, which the session survives.
+static void ReportItemError(Error error)
+{
+    fprintf(stderr, "Error: %s\n", toString(std::move(error)).c_str());
+    itemFailed = true;
+}
+
+// With profile-guided reoptimization, every compiled definition counts its calls and branches.
+// A background thread recompiles the hot ones at -O3 with the counts as branch weights, and points
+// their stubs at the result.
+struct ProfiledFunction {
+    std::string name;
+    unsigned version = 0;
+    const FunctionAST* definition = nullptr;
+    const MemoCache* memoCache = nullptr;
+    // Updated by the running code. Replaced versions may still be running, so they are never freed.
+    std::unique_ptr<uint64_t[]> counters;
+    size_t counterCount = 0;
+    // A newer definition is in the stub.
+    bool superseded = false;
+    bool reoptimized = false;
+};
+// Held while stubs are pointed at new versions, so the reoptimizer never brings back a replaced
+// definition. Guards the profiles too.
+static std::mutex stubsMutex;
+static std::vector<std::unique_ptr<ProfiledFunction>> profiledFunctions;
+static std::vector<ResourceTrackerSP> reoptimizedTrackers;
+static std::thread theReoptimizer;
+static std::condition_variable reoptimizerWakeUp;
+static bool reoptimizerStopping = false;
+
+// Calls plus conditions evaluated, loop iterations included.
+static uint64_t GetHotness(const ProfiledFunction& profile)
+{
+    uint64_t hotness = 0;
+    for (size_t i = 0; i < profile.counterCount; i++) {
+        hotness += profile.counters[i];
+    }
+    return hotness;
+}
+
+// Errors are reported and leave the current version in the stub. The reoptimizer must not exit the
+// process, as the exit handlers wait for it.
+static void ReoptimizeFunction(ProfiledFunction& profile)
+{
+    // The code keeps counting while it is recompiled.
+    std::vector<uint64_t> counts(profile.counters.get(), profile.counters.get() + profile.counterCount);
+    PhaseTimes times;
+    JITTargetMachineBuilder jtmb = theJIT->getTargetMachineBuilder();
+    auto targetMachine = jtmb.createTargetMachine();
+    if (!targetMachine) {
+        fprintf(stderr, "Error: %s\n", toString(targetMachine.takeError()).c_str());
+        return;
+    }
+    CodeGenerator generator;
+    StartModule(generator, targetMachine->get(), OptimizationLevel::O3);
+    // The main thread creates the stubs, so only the existing specializations are called.
+    EnableSpecialization(generator, false);
+    Function* function;
+    {
+        PhaseTimer timer(times, Phase::Codegen);
+        generator.UseProfileForNextFunction(counts.data());
+        generator.MemoizeNextFunction(profile.memoCache);
+        function = generator.GenerateCodeForFunction(profile.definition);
+    }
+    if (!function) {
+        return;
+    }
+    {
+        PhaseTimer timer(times, Phase::Optimize);
+        generator.RunOptmizationPasses();
+    }
+    std::string implName = profile.name + "." + std::to_string(profile.version) + ".opt";
+    function->setName(implName);
+    ResourceTrackerSP rt;
+    {
+        // Compiled before taking the lock, which only covers the pointer update.
+        PhaseTimer timer(times, Phase::JIT);
+        auto added = AddModuleToJIT(generator, true);
+        if (!added) {
+            fprintf(stderr, "Error: %s\n", toString(added.takeError()).c_str());
+            return;
+        }
+        rt = *added;
+        if (auto symbol = theJIT->lookup(implName); !symbol) {
+            fprintf(stderr, "Error: %s\n", toString(symbol.takeError()).c_str());
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> lock(stubsMutex);
+    reoptimizedTrackers.push_back(rt);
+    if (!profile.superseded) {
+        if (Error error = theJIT->redirectStub(profile.name, implName)) {
+            fprintf(stderr, "Error: %s\n", toString(std::move(error)).c_str());
+            return;
+        }
+        ReportItemTimes("reoptimize", { profile.name }, times);
+    }
+}
+
+static void RunReoptimizer()
+{
+    std::unique_lock<std::mutex> lock(stubsMutex);
+    while (!reoptimizerStopping) {
+        reoptimizerWakeUp.wait_for(lock, std::chrono::milliseconds(10));
+        // Functions are added while the lock is released, and never removed.
+        for (size_t i = 0; i < profiledFunctions.size() && !reoptimizerStopping; i++) {
+            ProfiledFunction& profile = *profiledFunctions[i];
+            if (profile.superseded || profile.reoptimized ||
+                GetHotness(profile) < compilerOptions.reoptimizeThreshold) {
+                continue;
+            }
+            profile.reoptimized = true;
+            lock.unlock();
+            ReoptimizeFunction(profile);
+            lock.lock();
+        }
+    }
+}
+
+// Runs before the static objects the reoptimizer uses are destroyed, those of other files
+// included, since it is registered once they are all constructed.
+static void StopReoptimizer()
+{
+    // The reoptimizer itself exiting cannot wait for its own end.
+    if (std::this_thread::get_id() == theReoptimizer.get_id()) {
+        theReoptimizer.detach();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(stubsMutex);
+        reoptimizerStopping = true;
+    }
+    reoptimizerWakeUp.notify_one();
+    theReoptimizer.join();
+}
+
+static void StartReoptimizer()
+{
+    theReoptimizer = std::thread(RunReoptimizer);
+    std::atexit(StopReoptimizer);
+}
+
+// Creates the stubs of new specializations, and compiles the ones whose callee has a version they
+// were not compiled from, in a module per callee. Adds the stubs to point at the new code to
+// redirects.
+static void GenerateSpecializations(std::vector<std::pair<std::string, std::string>>& redirects, PhaseTimes& times)
+{
+    std::map<std::string, std::vector<Specialization*>> outdated;
+    {
+        std::lock_guard<std::mutex> lock(specializationsMutex);
+        for (auto& entry : specializations) {
+            Specialization& specialization = *entry.second;
+            if (!specialization.stubbed) {
+                if (Error error = theJIT->createStub(specialization.name)) {
+                    ReportItemError(std::move(error));
+                    continue;
+                }
+                specialization.stubbed = true;
+            }
+            // A callee that failed to compile leaves its specializations reporting the error, like
+            // its own stub.
+            auto iter = definedFunctions.find(specialization.callee);
+            if (iter != definedFunctions.end() && iter->second.definition &&
+                iter->second.version != specialization.calleeVersion) {
+                outdated[specialization.callee].push_back(&specialization);
+            }
+        }
+    }
+    for (auto& [callee, calleeSpecializations] : outdated) {
+        DefinedFunction& record = definedFunctions[callee];
+        CodeGenerator generator;
+        StartModule(generator, theTargetMachine.get(), GetOptimizationLevel(compilerOptions.optLevel));
+        // Calls in the copies of the body only go to specializations that have a stub by now.
+        EnableSpecialization(generator, false);
+        {
+            PhaseTimer timer(times, Phase::Codegen);
+            Function* generic = generator.GenerateCodeForFunction(record.definition);
+            if (!generic) {
+                continue;
+            }
+            for (Specialization* specialization : calleeSpecializations) {
+                generator.GenerateCodeForSpecialization(generic, specialization->constants,
+                    specialization->name + "." + std::to_string(record.version));
+            }
+        }
+        {
+            PhaseTimer timer(times, Phase::Optimize);
+            generator.RunOptmizationPasses();
+        }
+        if (compilerOptions.dumpIR) {
+            std::cout << "=============== LLVM IR (OPTed) ===============" << std::endl;
+            generator.GetModule()->print(llvm::outs(), nullptr);
+        }
+        {
+            PhaseTimer timer(times, Phase::JIT);
+            auto rt = AddModuleToJIT(generator);
+            if (!rt) {
+                ReportItemError(rt.takeError());
+                continue;
+            }
+            record.trackers.push_back(*rt);
+        }
+        for (Specialization* specialization : calleeSpecializations) {
+            specialization->calleeVersion = record.version;
+            redirects.emplace_back(specialization->name, specialization->name + "." + std::to_string(record.version));
+        }
+    }
+}
+
+// Compiles the specializations a map wrapper calls, which runs outside of FlushDefinitions.
+static void FlushSpecializations(PhaseTimes& times)
+{
+    std::vector<std::pair<std::string, std::string>> redirects;
+    GenerateSpecializations(redirects, times);
+    if (!redirects.empty()) {
+        std::lock_guard<std::mutex> lock(stubsMutex);
+        if (Error error = theJIT->redirectStubs(redirects)) {
+            ReportItemError(std::move(error));
+        }
+    }
+}
+
+// A slice of the pending definitions, generated and optimized into one module on a worker thread.
+// Functions in the same module call each other directly, which is what lets them be inlined into
+// one another. Calls between modules go through the stubs.
+struct CompileJob {
+    llvm::ArrayRef<const FunctionAST*> definitions;
+    // The generated functions, or null for the definitions that failed to compile.
+    std::vector<Function*> functions;
+    // The IR dumps, printed in order once every job is done.
+    std::string dump;
+    PhaseTimes times;
+    CodeGenerator generator;
+    // Counters of the generated functions, while profiling.
+    std::vector<std::unique_ptr<ProfiledFunction>> profiles;
+    // Set if the job could not start, leaving every definition failed and no module.
+    std::string error;
+};
+
+static void RunCompileJob(CompileJob& job)
+{
+    // Target machines cache subtargets without locking, so each job builds its own.
+    // Exiting here would run the exit handlers while other jobs still use LLVM.
+    JITTargetMachineBuilder jtmb = theJIT->getTargetMachineBuilder();
+    auto targetMachine = jtmb.createTargetMachine();
+    if (!targetMachine) {
+        job.error = toString(targetMachine.takeError());
+        job.functions.assign(job.definitions.size(), nullptr);
+        job.profiles.resize(job.definitions.size());
+        return;
+    }
+    StartModule(job.generator, targetMachine->get(), GetOptimizationLevel(compilerOptions.optLevel));
+    EnableSpecialization(job.generator, true);
+    raw_string_ostream dump(job.dump);
+    for (auto def : job.definitions) {
+        std::unique_ptr<ProfiledFunction> profile;
+        if (compilerOptions.reoptimizeThreshold != 0) {
+            profile = std::make_unique<ProfiledFunction>();
+            profile->definition = def;
+            profile->counterCount = ProfileCounterCount(def);
+            profile->counters = std::make_unique<uint64_t[]>(profile->counterCount);
+            profile->memoCache = FindMemoCache(def);
+            job.generator.InstrumentNextFunction(profile->counters.get());
+        }
+        job.generator.MemoizeNextFunction(FindMemoCache(def));
+        Function* llvmFunc;
+        {
+            PhaseTimer timer(job.times, Phase::Codegen);
+            llvmFunc = job.generator.GenerateCodeForFunction(def);
+        }
+        job.functions.push_back(llvmFunc);
+        job.profiles.push_back(std::move(profile));
+        if (llvmFunc && compilerOptions.dumpIR) {
+            dump << "=============== LLVM IR ===============\n";
+            llvmFunc->print(dump);
+        }
+    }
+    {
+        PhaseTimer timer(job.times, Phase::Optimize);
+        job.generator.RunOptmizationPasses();
+    }
+    if (compilerOptions.dumpIR) {
+        dump << "=============== LLVM IR (OPTed) ===============\n";
+        job.generator.GetModule()->print(dump, nullptr);
+    }
+}
+
+// Queues the functions def calls that are still interpreted for compilation, and the ones they
+// call in turn. Compiled code only calls compiled code.
+static void QueueInterpretedCallees(const FunctionAST* def)
+{
+    SmallVector<StringRef, 8> callees;
+    CollectCallees(def, callees);
+    for (StringRef callee : callees) {
+        auto iter = definedFunctions.find(callee.str());
+        if (iter != definedFunctions.end() && iter->second.interpreted) {
+            iter->second.interpreted = false;
+            pendingDefinitions.push_back(iter->second.definition);
+            QueueInterpretedCallees(iter->second.definition);
+        }
+    }
+}
+
+// Forgets a pending definition that failed to compile, putting back the extern of the same name
+// if there was one.
+static void ForgetDefinition(const std::string& name, const std::map<std::string, const PrototypeAST*>& previousPrototypes)
+{
+    auto iter = previousPrototypes.find(name);
+    if (iter != previousPrototypes.end() && iter->second) {
+        RegisterPrototype(iter->second);
+    } else {
+        UnregisterPrototype(name);
+    }
 }
 
-void HandleDefinition()
+// With tiered execution, new functions start out in the interpreter. Functions with loops,
+// redefinitions of functions that have a stub, which compiled callers reach them through, and
+// promoted functions stay pending, along with the interpreted functions they call.
+static void InterpretNewDefinitions(const std::map<std::string, const PrototypeAST*>& previousPrototypes)
+{
+    std::vector<const FunctionAST*> compiled;
+    for (auto def : pendingDefinitions) {
+        std::string name = def->GetPrototype()->GetName().str();
+        auto iter = definedFunctions.find(name);
+        bool known = iter != definedFunctions.end();
+        if (known && (iter->second.stubbed || (iter->second.definition == def && !iter->second.interpreted))) {
+            compiled.push_back(def);
+            continue;
+        }
+        // Errors are reported when the function is defined, as if it were compiled.
+        if (!CheckFunction(def)) {
+            std::cerr << "Codegen error occurred" << std::endl;
+            itemFailed = true;
+            if (!known) {
+                ForgetDefinition(name, previousPrototypes);
+            }
+            continue;
+        }
+        if (!IsWorthInterpreting(def)) {
+            compiled.push_back(def);
+            continue;
+        }
+        DefinedFunction& record = definedFunctions[name];
+        record.argCount = def->GetPrototype()->GetArgs().size();
+        record.definition = def;
+        record.interpreted = true;
+        record.interpretedCalls = 0;
+    }
+    pendingDefinitions = std::move(compiled);
+    for (size_t i = 0; i < pendingDefinitions.size(); i++) {
+        QueueInterpretedCallees(pendingDefinitions[i]);
+    }
+}
+
+// Compiles the pending definitions and points their stubs at the new versions.
+static void FlushDefinitions()
+{
+    if (pendingDefinitions.empty()) {
+        return;
+    }
+    QueueStaleMemoizedFunctions();
+    // Every definition can call every other one, whichever module it ends up in.
+    std::map<std::string, const PrototypeAST*> previousPrototypes;
+    for (auto def : pendingDefinitions) {
+        previousPrototypes.emplace(def->GetPrototype()->GetName().str(), LookupPrototype(def->GetPrototype()->GetName()));
+        RegisterPrototype(def->GetPrototype());
+    }
+    if (compilerOptions.tierThreshold != 0) {
+        std::vector<std::string> names;
+        for (auto def : pendingDefinitions) {
+            names.push_back(def->GetPrototype()->GetName().str());
+        }
+        InterpretNewDefinitions(previousPrototypes);
+        if (pendingDefinitions.empty()) {
+            ReportItemTimes("definitions", names, itemTimes);
+            return;
+        }
+    }
+    for (auto def : pendingDefinitions) {
+        if (def->IsMemoized()) {
+            CreateMemoCache(def);
+        }
+    }
+    // A copy of a memoized function would bypass its cache.
+    if (compilerOptions.specializationCacheSize != 0) {
+        std::lock_guard<std::mutex> lock(specializationsMutex);
+        for (auto def : pendingDefinitions) {
+            if (!def->IsMemoized()) {
+                specializableFunctions.insert(def->GetPrototype()->GetName().str());
+            }
+        }
+    }
+    size_t jobCount = std::min<size_t>(std::max(compilerOptions.compileThreads, 1u), pendingDefinitions.size());
+    std::vector<CompileJob> jobs(jobCount);
+    size_t begin = 0;
+    for (size_t i = 0; i < jobCount; i++) {
+        // Neighbouring definitions tend to call each other, so jobs get contiguous slices.
+        size_t end = pendingDefinitions.size() * (i + 1) / jobCount;
+        jobs[i].definitions = llvm::ArrayRef<const FunctionAST*>(pendingDefinitions).slice(begin, end - begin);
+        begin = end;
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < jobCount; i++) {
+        workers.emplace_back(RunCompileJob, std::ref(jobs[i]));
+    }
+    RunCompileJob(jobs[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<std::pair<std::string, std::string>> redirects;
+    std::vector<std::unique_ptr<ProfiledFunction>> profiles;
+    // Records of the batch's functions as they were, for the ones whose new version fails to link.
+    std::map<std::string, DefinedFunction> previousRecords;
+    for (auto& job : jobs) {
+        if (!job.error.empty()) {
+            fprintf(stderr, "Error: %s\n", job.error.c_str());
+        }
+        itemTimes += job.times;
+        std::cout << job.dump;
+        for (size_t i = 0; i < job.definitions.size(); i++) {
+            std::string name = job.definitions[i]->GetPrototype()->GetName().str();
+            if (job.functions[i] == nullptr) {
+                std::cerr << "Codegen error occurred" << std::endl;
+                itemFailed = true;
+                continue;
+            }
+            DefinedFunction& record = definedFunctions[name];
+            // Versions are never reused, as failed ones may stay in the JIT.
+            std::string implName = name + "." + std::to_string(++record.version);
+            job.functions[i]->setName(implName);
+            if (!record.stubbed) {
+                if (Error error = theJIT->createStub(name)) {
+                    ReportItemError(std::move(error));
+                    continue;
+                }
+                record.stubbed = true;
+            }
+            previousRecords.emplace(name, record);
+            record.argCount = job.definitions[i]->GetPrototype()->GetArgs().size();
+            record.definition = job.definitions[i];
+            record.interpreted = false;
+            redirects.emplace_back(name, implName);
+            if (job.profiles[i]) {
+                job.profiles[i]->name = name;
+                job.profiles[i]->version = record.version;
+                profiles.push_back(std::move(job.profiles[i]));
+            }
+        }
+    }
+    // A definition that failed to compile is forgotten unless other definitions of the batch
+    // already call it. Those get a stub that reports the error and returns NaN when called. With
+    // tiered execution, an interpreted function keeps running its last definition that passed the
+    // checks.
+    for (auto def : pendingDefinitions) {
+        std::string name = def->GetPrototype()->GetName().str();
+        auto iter = definedFunctions.find(name);
+        if (iter != definedFunctions.end() && iter->second.stubbed) {
+            continue;
+        }
+        bool called = std::any_of(jobs.begin(), jobs.end(), [&](CompileJob& job) {
+            return job.generator.GetModule() && job.generator.GetModule()->getFunction(name) != nullptr;
+        });
+        bool promoted = iter != definedFunctions.end() && iter->second.definition == def;
+        if (called) {
+            DefinedFunction& record = definedFunctions[name];
+            record.argCount = def->GetPrototype()->GetArgs().size();
+            if (Error error = theJIT->createStub(name)) {
+                ReportItemError(std::move(error));
+            } else {
+                record.stubbed = true;
+            }
+        } else if (iter == definedFunctions.end()) {
+            ForgetDefinition(name, previousPrototypes);
+        }
+        if (promoted) {
+            iter->second.interpreted = true;
+        }
+    }
+    std::vector<std::string> names;
+    for (auto def : pendingDefinitions) {
+        names.push_back(def->GetPrototype()->GetName().str());
+    }
+    pendingDefinitions.clear();
+    // Both for the calls the batch makes and for the callees it redefines.
+    GenerateSpecializations(redirects, itemTimes);
+    {
+        PhaseTimer timer(itemTimes, Phase::JIT);
+        // Functions whose new version did not link. Their stubs keep the version they had.
+        std::set<std::string> failed;
+        std::vector<ResourceTrackerSP> trackers(jobs.size());
+        for (size_t j = 0; j < jobs.size(); j++) {
+            if (!jobs[j].generator.GetModule()) {
+                continue;
+            }
+            auto rt = AddModuleToJIT(jobs[j].generator);
+            if (!rt) {
+                ReportItemError(rt.takeError());
+                for (auto def : jobs[j].definitions) {
+                    failed.insert(def->GetPrototype()->GetName().str());
+                }
+                continue;
+            }
+            trackers[j] = *rt;
+        }
+        llvm::erase_if(redirects, [&](auto& redirect) { return failed.count(redirect.first) != 0; });
+        std::lock_guard<std::mutex> lock(stubsMutex);
+        if (Error error = theJIT->redirectStubs(redirects)) {
+            ReportItemError(std::move(error));
+            // One at a time, the functions that did link still get their new version.
+            for (auto& redirect : redirects) {
+                if (Error redirectError = theJIT->redirectStub(redirect.first, redirect.second)) {
+                    consumeError(std::move(redirectError));
+                    failed.insert(redirect.first);
+                }
+            }
+        }
+        if (compilerOptions.reoptimizeThreshold != 0) {
+            std::set<std::string> redirected;
+            for (auto& redirect : redirects) {
+                if (failed.count(redirect.first) == 0) {
+                    redirected.insert(redirect.first);
+                }
+            }
+            for (auto& profile : profiledFunctions) {
+                if (redirected.count(profile->name) != 0) {
+                    profile->superseded = true;
+                }
+            }
+            for (auto& profile : profiles) {
+                if (redirected.count(profile->name) != 0) {
+                    profiledFunctions.push_back(std::move(profile));
+                }
+            }
+        }
+        // A module is only removed once no stub points into it.
+        for (size_t j = 0; j < jobs.size(); j++) {
+            bool used = false;
+            for (size_t i = 0; i < jobs[j].definitions.size(); i++) {
+                std::string name = jobs[j].definitions[i]->GetPrototype()->GetName().str();
+                auto previous = previousRecords.find(name);
+                if (!jobs[j].functions[i] || previous == previousRecords.end()) {
+                    continue;
+                }
+                DefinedFunction& record = definedFunctions[name];
+                if (failed.count(name) == 0) {
+                    record.trackers.push_back(trackers[j]);
+                    used = true;
+                } else {
+                    record.definition = previous->second.definition;
+                    record.interpreted = previous->second.interpreted;
+                }
+            }
+            if (trackers[j] && !used) {
+                if (Error error = trackers[j]->remove()) {
+                    ReportItemError(std::move(error));
+                }
+            }
+        }
+    }
+    ReportItemTimes("definitions", names, itemTimes);
+}
+
+void HandleDefinition(const FunctionAST* def)
 {
-    auto def = ParseDefinition();
     if (def) {
-        std::cout << "===============   AST   ===============" << std::endl;
-        def->PrettyPrint();
-        auto llvmFunc = GenerateCodeForFunction(def.get());
-        if (llvmFunc == nullptr) {
-            std::cout << "Codegen error occurred" << std::endl;
+        if (compilerOptions.dumpAST) {
+            std::cout << "===============   AST   ===============" << std::endl;
+            def->PrettyPrint();
+        }
+        std::string name = def->GetPrototype()->GetName().str();
+        auto iter = definedFunctions.find(name);
+        if (iter != definedFunctions.end() && iter->second.argCount != def->GetPrototype()->GetArgs().size()) {
+            fprintf(stderr, "Error: Function cannot be redefined with a different number of arguments: %s\n",
+                name.c_str());
+            itemFailed = true;
             return;
         }
-        // JIT consumes llvm module, therefore we store AST so the function can be regenerate
-        // again in the future.
-        functions.emplace_back(std::move(def));
-        std::cout << "=============== LLVM IR ===============" << std::endl;
-        llvmFunc->print(llvm::outs());
-        RunOptmizationPasses(llvmFunc);
-        std::cout << "=============== LLVM IR (OPTed) ===============" << std::endl;
-        llvmFunc->print(llvm::outs());
+        bool compileAlone = !groupDefinitions || redefinedFunctions.count(name) != 0;
+        if (compileAlone) {
+            FlushDefinitions();
+        }
+        pendingDefinitions.push_back(def);
+        if (compileAlone) {
+            FlushDefinitions();
+        }
     }
      else {
-        std::cout << "Parse definition failed" << std::endl;
+        std::cerr << "Parse definition failed" << std::endl;
+        itemFailed = true;
     }
 }
 
-void HandleExtern()
+void HandleExtern(const PrototypeAST* def)
 {
-    auto def = ParseExtern();
     if (def) {
-        std::cout << "===============   AST   ===============" << std::endl;
-        def->PrettyPrint();
-        auto llvmFunc = GenerateCodeForPrototype(def.get());
+        if (compilerOptions.dumpAST) {
+            std::cout << "===============   AST   ===============" << std::endl;
+            def->PrettyPrint();
+        }
+        Function* llvmFunc;
+        {
+            PhaseTimer timer(itemTimes, Phase::Codegen);
+            llvmFunc = theCodeGenerator.GenerateCodeForPrototype(def);
+        }
         if (llvmFunc == nullptr) {
-            std::cout << "Codegen error occurred" << std::endl;
+            std::cerr << "Codegen error occurred" << std::endl;
+            itemFailed = true;
             return;
         }
-        functions.emplace_back(std::move(def));
-        std::cout << "=============== LLVM IR ===============" << std::endl;
-        llvmFunc->print(llvm::outs());
+        if (compilerOptions.dumpIR) {
+            std::cout << "=============== LLVM IR ===============" << std::endl;
+            llvmFunc->print(llvm::outs());
+        }
+        RegisterPrototype(def);
+        ReportItemTimes("extern", { def->GetName().str() }, itemTimes);
     } else {
-        std::cout << "Parse extern failed" << std::endl;
+        std::cerr << "Parse extern failed" << std::endl;
+        itemFailed = true;
+    }
+}
+
+// Compiles a function that has been running in the interpreter, and the interpreted functions it
+// calls. They are an item of their own.
+static void PromoteFunction(DefinedFunction& record)
+{
+    PhaseTimes callerTimes = itemTimes;
+    itemTimes = PhaseTimes();
+    record.interpreted = false;
+    pendingDefinitions.push_back(record.definition);
+    FlushDefinitions();
+    itemTimes = callerTimes;
+}
+
+// Decides what the interpreter runs for a call. A function is interpreted until the interpreter
+// has called it compilerOptions.tierThreshold times, and the call after runs it compiled. Compiled
+// functions are called through their stubs, externs through the JIT's symbol lookup.
+static bool ResolveInterpretedCall(StringRef name, CallTarget& target)
+{
+    auto iter = definedFunctions.find(name.str());
+    if (iter != definedFunctions.end()) {
+        DefinedFunction& record = iter->second;
+        // A function that fails to compile is only tried once, and keeps being interpreted.
+        if (record.interpreted && ++record.interpretedCalls == compilerOptions.tierThreshold + 1) {
+            PromoteFunction(record);
+        }
+        if (record.interpreted) {
+            target.definition = record.definition;
+            return true;
+        }
+        if (!record.stubAddress) {
+            auto stub = theJIT->lookup(name);
+            if (!stub) {
+                fprintf(stderr, "Error: %s\n", toString(stub.takeError()).c_str());
+                return false;
+            }
+            record.stubAddress = ExecutorAddr(stub->getAddress()).toPtr<void*>();
+        }
+        target.address = record.stubAddress;
+        return true;
+    }
+    if (!LookupPrototype(name)) {
+        fprintf(stderr, "Error: Unknown function referenced: %s\n", name.str().c_str());
+        return false;
+    }
+    auto symbol = theJIT->lookup(name);
+    if (!symbol) {
+        fprintf(stderr, "Error: %s\n", toString(symbol.takeError()).c_str());
+        return false;
     }
+    target.address = ExecutorAddr(symbol->getAddress()).toPtr<void*>();
+    return true;
+}
+
+static Interpreter theInterpreter(ResolveInterpretedCall);
+
+// Runs a top-level expression in the interpreter, which skips code generation altogether.
+static void InterpretTopLevelExpression(const FunctionAST* func)
+{
+    if (!CheckFunction(func)) {
+        std::cerr << "Codegen error occurred" << std::endl;
+        itemFailed = true;
+        return;
+    }
+    double result;
+    bool succeeded;
+    {
+        // Includes compiling the functions that become hot while it runs.
+        PhaseTimer timer(itemTimes, Phase::Execute);
+        succeeded = theInterpreter.Run(func, {}, result);
+    }
+    if (!succeeded) {
+        std::cerr << "Evaluation failed" << std::endl;
+        itemFailed = true;
+        return;
+    }
+    if (compilerOptions.printResults) {
+        fprintf(stdout, "Evaluated to %f\n", result);
+    }
+    ReportItemTimes("expression", {}, itemTimes);
 }
 
-void HandleTopLevelExpression()
+void HandleTopLevelExpression(const FunctionAST* func)
 {
-    auto func = ParseTopLevelExpr();
     if (func) {
-        std::cout << "===============   AST   ===============" << std::endl;
-        func->PrettyPrint();
-        auto llvmFunc = GenerateCodeForFunction(func.get());
+        if (compilerOptions.dumpAST) {
+            std::cout << "===============   AST   ===============" << std::endl;
+            func->PrettyPrint();
+        }
+        // Everything the expression may call has to be in the JIT before it runs. The definitions
+        // are an item of their own, which the expression's parse time does not belong to.
+        PhaseTimes parseTimes = itemTimes;
+        itemTimes = PhaseTimes();
+        FlushDefinitions();
+        bool interpret = compilerOptions.tierThreshold != 0 && IsWorthInterpreting(func);
+        if (!interpret) {
+            QueueInterpretedCallees(func);
+            FlushDefinitions();
+        }
+        itemTimes = parseTimes;
+        if (interpret) {
+            InterpretTopLevelExpression(func);
+            return;
+        }
+        Function* llvmFunc;
+        {
+            PhaseTimer timer(itemTimes, Phase::Codegen);
+            llvmFunc = theCodeGenerator.GenerateCodeForFunction(func);
+        }
         if (llvmFunc == nullptr) {
-            std::cout << "Codegen error occurred" << std::endl;
+            std::cerr << "Codegen error occurred" << std::endl;
+            itemFailed = true;
             return;
         }
-        std::cout << "=============== LLVM IR ===============" << std::endl;
-        llvmFunc->print(llvm::outs());
-        RunOptmizationPasses(llvmFunc);
-        std::cout << "=============== LLVM IR (OPTed) ===============" << std::endl;
-        llvmFunc->print(llvm::outs());
-        std::cout << "=============== RESULT ===============" << std::endl;
-        auto rt = theJIT->getMainJITDylib().createResourceTracker();
-        auto module = GetModuleUniquePtr();
-        auto context = GetContextUniquePtr();
-        auto tsm = ThreadSafeModule(std::move(module), std::move(context));
-        ExitOnErr(theJIT->addModule(std::move(tsm), rt));
-        auto exprSymbol = ExitOnErr(theJIT->lookup("__anonymours_expr"));
-        assert(exprSymbol && "__anonymours_expr function not found");
-        auto executorAddr = ExecutorAddr(exprSymbol.getAddress());
-        double (*FP)() = executorAddr.toPtr<double (*)()>();
-        fprintf(stdout, "Evaluated to %f\n", FP());
-        ExitOnErr(rt->remove());
-        // The original module has been moved and consumed. We initialize a new one here.
-        InitializeModule();
-        // All previous generated functions are gone as well. We regenerate them here.
-        for (auto& item : functions) {
-            try {
-                auto& functionAST = std::get<std::unique_ptr<FunctionAST>>(item);
-                (void) GenerateCodeForFunction(functionAST.get());
-                continue;
-            } catch (const std::bad_variant_access& ex) { }
-            try {
-                auto& prototypeAST = std::get<std::unique_ptr<PrototypeAST>>(item);
-                (void) GenerateCodeForPrototype(prototypeAST.get());
-                continue;
-            } catch (const std::bad_variant_access& ex) { }
+        if (compilerOptions.dumpIR) {
+            std::cout << "=============== LLVM IR ===============" << std::endl;
+            llvmFunc->print(llvm::outs());
+        }
+        {
+            PhaseTimer timer(itemTimes, Phase::Optimize);
+            theCodeGenerator.RunOptmizationPasses();
+        }
+        if (compilerOptions.dumpIR) {
+            std::cout << "=============== LLVM IR (OPTed) ===============" << std::endl;
+            llvmFunc->print(llvm::outs());
+            std::cout << "=============== RESULT ===============" << std::endl;
+        }
+        // The anonymous expression is the only module that is thrown away after evaluation. It
+        // runs right away, so it is never worth compiling lazily.
+        ResourceTrackerSP rt;
+        double (*FP)();
+        {
+            PhaseTimer timer(itemTimes, Phase::JIT);
+            auto added = AddModuleToJIT(theCodeGenerator, true);
+            StartNextModule();
+            if (!added) {
+                ReportItemError(added.takeError());
+                return;
+            }
+            rt = *added;
+            auto exprSymbol = theJIT->lookup("__anonymours_expr");
+            if (!exprSymbol) {
+                ReportItemError(exprSymbol.takeError());
+                if (Error error = rt->remove()) {
+                    ReportItemError(std::move(error));
+                }
+                return;
+            }
+            FP = ExecutorAddr(exprSymbol->getAddress()).toPtr<double (*)()>();
+        }
+        double result;
+        {
+            PhaseTimer timer(itemTimes, Phase::Execute);
+            result = FP();
+        }
+        if (compilerOptions.printResults) {
+            fprintf(stdout, "Evaluated to %f\n", result);
+        }
+        if (Error error = rt->remove()) {
+            ReportItemError(std::move(error));
         }
+        ReportItemTimes("expression", {}, itemTimes);
     } else {
-        std::cout << "Parse top-level expression failed" << std::endl;
+        std::cerr << "Parse top-level expression failed" << std::endl;
+        itemFailed = true;
     }
 }
 
-bool Parse() {
-    switch (GetCurrentToken()) {
+MapFunction GetMapFunction(std::string_view name)
+{
+    auto iter = definedFunctions.find(std::string(name));
+    if (iter == definedFunctions.end() || !iter->second.definition) {
+        fprintf(stderr, "Error: Unknown function: %.*s\n", static_cast<int>(name.size()), name.data());
+        return nullptr;
+    }
+    DefinedFunction& record = iter->second;
+    // The wrapper calls the functions the definition calls through their stubs.
+    if (record.interpreted) {
+        PromoteFunction(record);
+        if (record.interpreted) {
+            return nullptr;
+        }
+    }
+    if (record.mapFunction && record.mapVersion == record.version) {
+        return record.mapFunction;
+    }
+    // The body is generated again next to the loop so it can be inlined, and the loop is worth
+    // the most aggressive pipeline whatever the session's level.
+    std::string wrapperName = std::string(name) + ".map." + std::to_string(record.version);
+    CodeGenerator generator;
+    StartModule(generator, theTargetMachine.get(), OptimizationLevel::O3);
+    EnableSpecialization(generator, true);
+    PhaseTimes mapTimes;
+    {
+        PhaseTimer timer(mapTimes, Phase::Codegen);
+        generator.MemoizeNextFunction(FindMemoCache(record.definition));
+        if (!generator.GenerateCodeForMapWrapper(record.definition, wrapperName)) {
+            std::cerr << "Codegen error occurred" << std::endl;
+            return nullptr;
+        }
+    }
+    {
+        PhaseTimer timer(mapTimes, Phase::Optimize);
+        generator.RunOptmizationPasses();
+    }
+    FlushSpecializations(mapTimes);
+    if (compilerOptions.dumpIR) {
+        std::cout << "=============== LLVM IR (OPTed) ===============" << std::endl;
+        generator.GetModule()->print(llvm::outs(), nullptr);
+    }
+    {
+        PhaseTimer timer(mapTimes, Phase::JIT);
+        auto rt = AddModuleToJIT(generator, true);
+        if (!rt) {
+            fprintf(stderr, "Error: %s\n", toString(rt.takeError()).c_str());
+            return nullptr;
+        }
+        record.trackers.push_back(*rt);
+        auto wrapperSymbol = theJIT->lookup(wrapperName);
+        if (!wrapperSymbol) {
+            fprintf(stderr, "Error: %s\n", toString(wrapperSymbol.takeError()).c_str());
+            return nullptr;
+        }
+        record.mapFunction = ExecutorAddr(wrapperSymbol->getAddress()).toPtr<MapFunction>();
+    }
+    record.mapVersion = record.version;
+    ReportItemTimes("map", { std::string(name) }, mapTimes);
+    return record.mapFunction;
+}
+
+bool GetMemoStats(std::string_view name, MemoStats& stats)
+{
+    auto iter = definedFunctions.find(std::string(name));
+    const MemoCache* cache = iter != definedFunctions.end() ? FindMemoCache(iter->second.definition) : nullptr;
+    if (!cache) {
+        fprintf(stderr, "Error: %.*s is not memoized\n", static_cast<int>(name.size()), name.data());
+        return false;
+    }
+    stats.hits = cache->counters[0];
+    stats.misses = cache->counters[1];
+    stats.capacity = cache->capacity;
+    return true;
+}
+
+static void HandleMemoCommand(const ReplCommand& command)
+{
+    MemoStats stats;
+    if (GetMemoStats(command.function, stats)) {
+        fprintf(stdout, "%s: %llu hits, %llu misses, %zu slots\n", command.function.c_str(),
+            static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses), stats.capacity);
+    }
+}
+
+void HandleMapCommand(const ReplCommand& command)
+{
+    auto iter = definedFunctions.find(command.function);
+    if (iter != definedFunctions.end() && iter->second.argCount != command.inputs.size()) {
+        fprintf(stderr, "Error: %s takes %zu arguments, not %zu\n", command.function.c_str(),
+            iter->second.argCount, command.inputs.size());
+        return;
+    }
+    size_t count = command.inputs.empty() ? 0 : command.inputs[0].size();
+    std::vector<const double*> inputs;
+    for (auto& values : command.inputs) {
+        if (values.size() != count) {
+            fprintf(stderr, "Error: Lists passed to :map differ in length\n");
+            return;
+        }
+        inputs.push_back(values.data());
+    }
+    MapFunction mapFunction = GetMapFunction(command.function);
+    if (!mapFunction) {
+        return;
+    }
+    std::vector<double> output(count);
+    mapFunction(inputs.data(), output.data(), static_cast<int64_t>(count));
+    std::cout << "Mapped to";
+    for (double value : output) {
+        fprintf(stdout, " %f", value);
+    }
+    fflush(stdout);
+    std::cout << std::endl;
+}
+
+bool Parse(Parser& parser) {
+    // Items that failed are not reported.
+    itemTimes = PhaseTimes();
+    switch (parser.GetCurrentToken()) {
         case tok_eof:
             return false;
         case ';':
-            GetNextToken();
+            parser.GetNextToken();
             break;
         case tok_def:
-            HandleDefinition();
+        case tok_memo: {
+            const FunctionAST* def;
+            {
+                PhaseTimer timer(itemTimes, Phase::Parse);
+                def = parser.ParseDefinition();
+            }
+            HandleDefinition(def);
             break;
-        case tok_extern:
-            HandleExtern();
+        }
+        case tok_extern: {
+            const PrototypeAST* def;
+            {
+                PhaseTimer timer(itemTimes, Phase::Parse);
+                def = parser.ParseExtern();
+            }
+            HandleExtern(def);
             break;
-        default:
-            HandleTopLevelExpression();
+        }
+        case ':': {
+            ReplCommand command;
+            if (!parser.ParseCommand(command)) {
+                break;
+            }
+            if (command.kind == ReplCommand::Memo) {
+                HandleMemoCommand(command);
+            } else {
+                HandleMapCommand(command);
+            }
+            break;
+        }
+        default: {
+            // A top-level expression is dropped once evaluated, so it gets an arena of its own.
+            ASTContext& sessionContext = parser.GetASTContext();
+            ASTContext exprContext;
+            parser.SetASTContext(exprContext);
+            const FunctionAST* expr;
+            {
+                PhaseTimer timer(itemTimes, Phase::Parse);
+                expr = parser.ParseTopLevelExpr();
+            }
+            HandleTopLevelExpression(expr);
+            parser.SetASTContext(sessionContext);
             break;
+        }
+    }
+    return true;
+}
+
+bool InitializeSession(const CompilerOptions& options)
+{
+    if (theJIT) {
+        fprintf(stderr, "Error: The compiler session is already running\n");
+        return false;
+    }
+    // Before any pass manager is built, so they all get the pass timers.
+    if (options.timePhases && !EnablePhaseTimings(options.timePhasesFile, options.statistics)) {
+        return false;
+    }
+    if (!SelectVectorLibrary(options)) {
+        return false;
+    }
+    // Vectorized code finds the library's functions among the process's symbols, like libm's.
+    std::string vectorLibraryPath = GetVectorLibraryPath(options);
+    std::string error;
+    if (!vectorLibraryPath.empty() &&
+        sys::DynamicLibrary::LoadLibraryPermanently(vectorLibraryPath.c_str(), &error)) {
+        fprintf(stderr, "Error: Cannot load vector library %s: %s\n", vectorLibraryPath.c_str(), error.c_str());
+        return false;
+    }
+    compilerOptions = options;
+    InitializeJIT(options);
+    StartNextModule();
+    if (options.reoptimizeThreshold != 0) {
+        StartReoptimizer();
     }
     return true;
 }
 
-void ReadEvalPrintLoop()
+bool RunSource(std::string_view source)
+{
+    itemFailed = false;
+    groupDefinitions = true;
+    // Parsed up front, then items are compiled in order.
+    std::vector<TopLevelItem> items;
+    {
+        PhaseTimer timer(itemTimes, Phase::Parse);
+        items = ParseSource(source, compilerOptions.parseThreads, astContexts);
+    }
+    ReportItemTimes("source", {}, itemTimes);
+    std::set<std::string> definedNames;
+    redefinedFunctions.clear();
+    for (auto& item : items) {
+        if (item.kind == TopLevelItem::Definition && item.function) {
+            std::string name = item.function->GetPrototype()->GetName().str();
+            if (!definedNames.insert(name).second) {
+                redefinedFunctions.insert(name);
+            }
+        }
+    }
+    for (auto& item : items) {
+        itemTimes = PhaseTimes();
+        switch (item.kind) {
+            case TopLevelItem::Definition:
+                HandleDefinition(item.function);
+                break;
+            case TopLevelItem::Extern:
+                HandleExtern(item.prototype);
+                break;
+            case TopLevelItem::Expression:
+                HandleTopLevelExpression(item.function);
+                break;
+        }
+    }
+    FlushDefinitions();
+    return !itemFailed;
+}
+
+void* GetFunctionAddress(std::string_view name, size_t argCount)
 {
-    InitializeJIT();
-    InitializeModule();
-    InitializePassManagers();
+    auto iter = definedFunctions.find(std::string(name));
+    if (iter == definedFunctions.end()) {
+        fprintf(stderr, "Error: Unknown function: %.*s\n", static_cast<int>(name.size()), name.data());
+        return nullptr;
+    }
+    if (iter->second.argCount != argCount) {
+        fprintf(stderr, "Error: %.*s takes %zu arguments, not %zu\n", static_cast<int>(name.size()), name.data(),
+            iter->second.argCount, argCount);
+        return nullptr;
+    }
+    if (iter->second.interpreted) {
+        PromoteFunction(iter->second);
+        if (iter->second.interpreted) {
+            return nullptr;
+        }
+    }
+    auto stub = theJIT->lookup(StringRef(name.data(), name.size()));
+    if (!stub) {
+        fprintf(stderr, "Error: %s\n", toString(stub.takeError()).c_str());
+        return nullptr;
+    }
+    return ExecutorAddr(stub->getAddress()).toPtr<void*>();
+}
+
+void ReadEvalPrintLoop(const CompilerOptions& options)
+{
+    if (!InitializeSession(options)) {
+        return;
+    }
+    astContexts.push_back(std::make_unique<ASTContext>());
+    Parser parser(*astContexts.back());
     bool run = true;
     while (run) {
-        std::cout << "ready > ";
-        GetNextToken();
-        run = Parse();
+        if (options.prompt) {
+            std::cout << "ready > ";
+        }
+        parser.GetNextToken();
+        run = Parse(parser);
+    }
+    if (options.dumpIR) {
+        auto theModule = theCodeGenerator.GetModule();
+        theModule->print(llvm::outs(), nullptr);
     }
-    auto theModule = GetModule();
-    theModule->print(llvm::outs(), nullptr);
+    ReportSessionTimes();
+}
+
+bool RunFile(const CompilerOptions& options)
+{
+    auto buffer = MemoryBuffer::getFile(options.inputFile, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", options.inputFile.c_str(),
+            buffer.getError().message().c_str());
+        return false;
+    }
+    auto startTime = std::chrono::steady_clock::now();
+    if (!InitializeSession(options)) {
+        return false;
+    }
+    // The source is mapped into memory, errors in it are reported as they are found.
+    bool succeeded = RunSource((*buffer)->getBuffer());
+    std::chrono::duration<double, std::milli> wallTime = std::chrono::steady_clock::now() - startTime;
+    fflush(stdout);
+    ReportSessionTimes();
+    fprintf(stderr, "Total time: %.3f ms\n", wallTime.count());
+    return succeeded;
+}
+
+bool MapFile(const CompilerOptions& options)
+{
+    auto buffer = MemoryBuffer::getFile(options.inputFile, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", options.inputFile.c_str(),
+            buffer.getError().message().c_str());
+        return false;
+    }
+    // Stdout carries the results, so nothing else may be printed there.
+    CompilerOptions sessionOptions = options;
+    sessionOptions.dumpAST = false;
+    sessionOptions.dumpIR = false;
+    sessionOptions.debugPassManager = false;
+    sessionOptions.printResults = false;
+    if (!InitializeSession(sessionOptions) || !RunSource((*buffer)->getBuffer())) {
+        return false;
+    }
+    MapFunction mapFunction = GetMapFunction(options.mapFunction);
+    if (!mapFunction) {
+        return false;
+    }
+    StreamMapOptions streamOptions;
+    streamOptions.inputFile = options.mapInput;
+    streamOptions.binary = options.mapBinary;
+    streamOptions.threads = options.mapThreads;
+    bool succeeded;
+    {
+        PhaseTimer timer(itemTimes, Phase::Execute);
+        succeeded = StreamMap(mapFunction, definedFunctions[options.mapFunction].argCount, streamOptions);
+    }
+    ReportItemTimes("rows", { options.mapFunction }, itemTimes);
+    ReportSessionTimes();
+    return succeeded;
+}
+
+// Target machine for code that is linked into other programs. It targets the baseline CPU of the
+// host's architecture rather than the host itself, and emits position independent code so the
+// object can go into a shared library.
+static std::unique_ptr<TargetMachine> CreateAheadOfTimeTargetMachine(const CompilerOptions& options)
+{
+    std::string triple = sys::getDefaultTargetTriple();
+    std::string error;
+    const Target* target = TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        return nullptr;
+    }
+    return std::unique_ptr<TargetMachine>(target->createTargetMachine(triple, "generic", "", TargetOptions(),
+        Reloc::PIC_, std::nullopt, GetCodeGenOptLevel(options.optLevel)));
+}
+
+static bool EmitObjectFile(const std::string& path)
+{
+    std::error_code error;
+    raw_fd_ostream out(path, error, sys::fs::OF_None);
+    if (error) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path.c_str(), error.message().c_str());
+        return false;
+    }
+    legacy::PassManager codegenPasses;
+    if (theTargetMachine->addPassesToEmitFile(codegenPasses, out, nullptr, CGFT_ObjectFile)) {
+        fprintf(stderr, "Error: The target cannot emit object files\n");
+        return false;
+    }
+    codegenPasses.run(*theCodeGenerator.GetModule());
+    out.close();
+    if (out.has_error()) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", path.c_str(), out.error().message().c_str());
+        out.clear_error();
+        return false;
+    }
+    return true;
+}
+
+// Links an object file into a shared library with the system compiler driver, which knows where
+// the C runtime and the linker are.
+static bool LinkSharedLibrary(const std::string& objectPath, const std::string& libraryPath,
+    const std::string& vectorLibraryPath)
+{
+    auto driver = sys::findProgramByName("cc");
+    if (!driver) {
+        fprintf(stderr, "Error: Cannot find cc to link %s\n", libraryPath.c_str());
+        return false;
+    }
+    std::string error;
+    std::vector<StringRef> args = { *driver, "-shared", "-o", libraryPath, objectPath };
+    // Before libm, which the vector library depends on.
+    if (!vectorLibraryPath.empty()) {
+        args.push_back(vectorLibraryPath);
+    } else if (vectorLibrary == TargetLibraryInfoImpl::LIBMVEC_X86) {
+        args.push_back("-lmvec");
+    }
+    args.push_back("-lm");
+    if (sys::ExecuteAndWait(*driver, args, std::nullopt, {}, 0, 0, &error) != 0) {
+        fprintf(stderr, "Error: Linking %s failed%s%s\n", libraryPath.c_str(), error.empty() ? "" : ": ",
+            error.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CompileFile(const CompilerOptions& options)
+{
+    auto buffer = MemoryBuffer::getFile(options.inputFile, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", options.inputFile.c_str(),
+            buffer.getError().message().c_str());
+        return false;
+    }
+    if (!SelectVectorLibrary(options)) {
+        return false;
+    }
+    compilerOptions = options;
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+    theTargetMachine = CreateAheadOfTimeTargetMachine(options);
+    if (!theTargetMachine) {
+        return false;
+    }
+    StartNextModule();
+    // The whole file becomes one module. Functions keep their names and call each other directly,
+    // there are no stubs to redefine them through.
+    bool succeeded = true;
+    auto items = ParseSource((*buffer)->getBuffer(), options.parseThreads, astContexts);
+    for (auto& item : items) {
+        switch (item.kind) {
+            case TopLevelItem::Definition:
+                if (!item.function) {
+                    succeeded = false;
+                    break;
+                }
+                if (compilerOptions.dumpAST) {
+                    item.function->PrettyPrint();
+                }
+                RegisterPrototype(item.function->GetPrototype());
+                if (!theCodeGenerator.GenerateCodeForFunction(item.function)) {
+                    succeeded = false;
+                }
+                break;
+            case TopLevelItem::Extern:
+                if (!item.prototype) {
+                    succeeded = false;
+                    break;
+                }
+                if (compilerOptions.dumpAST) {
+                    item.prototype->PrettyPrint();
+                }
+                if (!theCodeGenerator.GetModule()->getFunction(item.prototype->GetName())) {
+                    theCodeGenerator.GenerateCodeForPrototype(item.prototype);
+                }
+                // Lets calls to math builtins become intrinsics.
+                RegisterPrototype(item.prototype);
+                break;
+            case TopLevelItem::Expression:
+                fprintf(stderr, "Warning: Top-level expressions are not run when compiling ahead of time\n");
+                break;
+        }
+    }
+    if (!succeeded) {
+        return false;
+    }
+    theCodeGenerator.RunOptmizationPasses();
+    if (compilerOptions.dumpIR) {
+        theCodeGenerator.GetModule()->print(llvm::outs(), nullptr);
+    }
+    if (!options.emitObject.empty() && !EmitObjectFile(options.emitObject)) {
+        return false;
+    }
+    if (!options.emitShared.empty()) {
+        SmallString<128> objectPath;
+        if (auto error = sys::fs::createTemporaryFile("kale", "o", objectPath)) {
+            fprintf(stderr, "Error: Cannot create a temporary object file: %s\n", error.message().c_str());
+            return false;
+        }
+        bool linked = EmitObjectFile(objectPath.str().str()) &&
+            LinkSharedLibrary(objectPath.str().str(), options.emitShared, options.vectorLibraryPath);
+        sys::fs::remove(objectPath);
+        return linked;
+    }
+    return true;
 }
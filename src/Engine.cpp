@@ -0,0 +1,39 @@
+#include "Engine.h"
+
+std::unique_ptr<Engine> Engine::Create(const CompilerOptions& options)
+{
+    CompilerOptions sessionOptions = options;
+    sessionOptions.dumpAST = false;
+    sessionOptions.dumpIR = false;
+    sessionOptions.debugPassManager = false;
+    sessionOptions.prompt = false;
+    sessionOptions.printResults = false;
+    if (!InitializeSession(sessionOptions)) {
+        return nullptr;
+    }
+    return std::unique_ptr<Engine>(new Engine());
+}
+
+bool Engine::Compile(std::string_view source)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    return RunSource(source);
+}
+
+void* Engine::GetFunctionAddress(std::string_view name, size_t argCount)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    return ::GetFunctionAddress(name, argCount);
+}
+
+MapFunction Engine::GetMapFunction(std::string_view name)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    return ::GetMapFunction(name);
+}
+
+bool Engine::GetMemoStats(std::string_view name, MemoStats& stats)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    return ::GetMemoStats(name, stats);
+}
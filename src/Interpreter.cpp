@@ -0,0 +1,338 @@
+#include "Interpreter.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include "llvm/Support/Casting.h"
+
+#include "Codegen.h"
+
+using namespace llvm;
+
+static bool LogCheckError(const std::string& str)
+{
+    fprintf(stderr, "Error: %s\n", str.c_str());
+    return false;
+}
+
+static bool CheckExpr(const ExprAST* exprAST, SmallVectorImpl<StringRef>& scope)
+{
+    switch (exprAST->GetKind()) {
+        case ExprAST::Kind::Number:
+            return true;
+        case ExprAST::Kind::Variable: {
+            StringRef name = cast<VariableExprAST>(exprAST)->GetName();
+            if (std::find(scope.begin(), scope.end(), name) == scope.end()) {
+                return LogCheckError("Unknown variable name: " + name.str());
+            }
+            return true;
+        }
+        case ExprAST::Kind::Binary: {
+            auto binaryExprAST = cast<BinaryExprAST>(exprAST);
+            switch (binaryExprAST->GetOp()) {
+                case '=':
+                    if (!isa<VariableExprAST>(binaryExprAST->LHS)) {
+                        return LogCheckError("Destination of '=' must be a variable");
+                    }
+                    break;
+                case '+':
+                case '-':
+                case '*':
+                case '/':
+                case '<':
+                    break;
+                default:
+                    return LogCheckError("Invalid binary operator: " + std::string(1, binaryExprAST->GetOp()));
+            }
+            return CheckExpr(binaryExprAST->LHS, scope) && CheckExpr(binaryExprAST->RHS, scope);
+        }
+        case ExprAST::Kind::Call: {
+            auto callExprAST = cast<CallExprAST>(exprAST);
+            const PrototypeAST* callee = LookupPrototype(callExprAST->GetCallee());
+            if (!callee) {
+                return LogCheckError("Unknown function referenced: " + callExprAST->GetCallee().str());
+            }
+            if (callee->GetArgs().size() != callExprAST->GetArgs().size()) {
+                return LogCheckError("Incorrect # arguments passed");
+            }
+            return std::all_of(callExprAST->GetArgs().begin(), callExprAST->GetArgs().end(),
+                [&](const ExprAST* arg) { return CheckExpr(arg, scope); });
+        }
+        case ExprAST::Kind::If: {
+            auto ifExprAST = cast<IfExprAST>(exprAST);
+            return CheckExpr(ifExprAST->GetCondtionExpr(), scope) && CheckExpr(ifExprAST->GetThenExpr(), scope) &&
+                CheckExpr(ifExprAST->GetElseExpr(), scope);
+        }
+        case ExprAST::Kind::For: {
+            auto forExprAST = cast<ForExprAST>(exprAST);
+            if (!CheckExpr(forExprAST->GetStartExpr(), scope)) {
+                return false;
+            }
+            scope.push_back(forExprAST->GetVarName());
+            bool valid = CheckExpr(forExprAST->GetEndExpr(), scope) && CheckExpr(forExprAST->GetBodyExpr(), scope) &&
+                (!forExprAST->GetStepExpr() || CheckExpr(forExprAST->GetStepExpr(), scope));
+            scope.pop_back();
+            return valid;
+        }
+        case ExprAST::Kind::Var: {
+            auto varExprAST = cast<VarExprAST>(exprAST);
+            size_t outerSize = scope.size();
+            bool valid = true;
+            for (const VarExprAST::Binding& binding : varExprAST->GetBindings()) {
+                if (binding.init && !CheckExpr(binding.init, scope)) {
+                    valid = false;
+                    break;
+                }
+                scope.push_back(binding.name);
+            }
+            valid = valid && CheckExpr(varExprAST->GetBodyExpr(), scope);
+            scope.resize(outerSize);
+            return valid;
+        }
+    }
+    return false;
+}
+
+bool CheckFunction(const FunctionAST* function)
+{
+    SmallVector<StringRef, 8> scope(function->GetPrototype()->GetArgs().begin(),
+        function->GetPrototype()->GetArgs().end());
+    return CheckExpr(function->GetBody(), scope);
+}
+
+bool IsWorthInterpreting(const FunctionAST* function)
+{
+    if (function->IsMemoized()) {
+        return false;
+    }
+    auto visit = [](const ExprAST* exprAST) {
+        if (isa<ForExprAST>(exprAST)) {
+            return false;
+        }
+        auto callExprAST = dyn_cast<CallExprAST>(exprAST);
+        return !callExprAST || callExprAST->GetArgs().size() <= maxNativeCallArgs;
+    };
+    return VisitExprTree(function->GetBody(), visit);
+}
+
+void CollectCallees(const FunctionAST* function, SmallVectorImpl<StringRef>& callees)
+{
+    auto visit = [&](const ExprAST* exprAST) {
+        if (auto callExprAST = dyn_cast<CallExprAST>(exprAST)) {
+            if (std::find(callees.begin(), callees.end(), callExprAST->GetCallee()) == callees.end()) {
+                callees.push_back(callExprAST->GetCallee());
+            }
+        }
+        return true;
+    };
+    VisitExprTree(function->GetBody(), visit);
+}
+
+template<size_t>
+using Double = double;
+
+template<size_t... I>
+static double CallNative(void* address, const double* args, std::index_sequence<I...>)
+{
+    return reinterpret_cast<double (*)(Double<I>...)>(address)(args[I]...);
+}
+
+static double CallNative(void* address, ArrayRef<double> args)
+{
+    switch (args.size()) {
+        case 0:
+            return CallNative(address, args.data(), std::make_index_sequence<0>());
+        case 1:
+            return CallNative(address, args.data(), std::make_index_sequence<1>());
+        case 2:
+            return CallNative(address, args.data(), std::make_index_sequence<2>());
+        case 3:
+            return CallNative(address, args.data(), std::make_index_sequence<3>());
+        case 4:
+            return CallNative(address, args.data(), std::make_index_sequence<4>());
+        case 5:
+            return CallNative(address, args.data(), std::make_index_sequence<5>());
+        case 6:
+            return CallNative(address, args.data(), std::make_index_sequence<6>());
+        case 7:
+            return CallNative(address, args.data(), std::make_index_sequence<7>());
+        default:
+            static_assert(maxNativeCallArgs == 8, "CallNative handles up to 8 arguments");
+            return CallNative(address, args.data(), std::make_index_sequence<8>());
+    }
+}
+
+// Conditions hold for anything but 0 and NaN, like the ordered compare of the compiled code.
+static bool IsTrue(double value)
+{
+    return value < 0 || value > 0;
+}
+
+double* Interpreter::LookupVariable(StringRef name)
+{
+    for (size_t i = variables.size(); i > frameBase; i--) {
+        if (variables[i - 1].first == name) {
+            return &variables[i - 1].second;
+        }
+    }
+    fprintf(stderr, "Error: Unknown variable name: %s\n", name.str().c_str());
+    return nullptr;
+}
+
+bool Interpreter::EvaluateBinaryExpr(const BinaryExprAST* binaryExprAST, double& result)
+{
+    if (binaryExprAST->GetOp() == '=') {
+        if (!Evaluate(binaryExprAST->RHS, result)) {
+            return false;
+        }
+        double* variable = LookupVariable(cast<VariableExprAST>(binaryExprAST->LHS)->GetName());
+        if (!variable) {
+            return false;
+        }
+        *variable = result;
+        return true;
+    }
+    double LHS, RHS;
+    if (!Evaluate(binaryExprAST->LHS, LHS) || !Evaluate(binaryExprAST->RHS, RHS)) {
+        return false;
+    }
+    switch (binaryExprAST->GetOp()) {
+        case '+':
+            result = LHS + RHS;
+            return true;
+        case '-':
+            result = LHS - RHS;
+            return true;
+        case '*':
+            result = LHS * RHS;
+            return true;
+        case '/':
+            result = LHS / RHS;
+            return true;
+        case '<':
+            // Unordered or less than, like fcmp ult.
+            result = !(LHS >= RHS);
+            return true;
+        default:
+            fprintf(stderr, "Error: Invalid binary operator: %c\n", binaryExprAST->GetOp());
+            return false;
+    }
+}
+
+bool Interpreter::EvaluateCallExpr(const CallExprAST* callExprAST, double& result)
+{
+    SmallVector<double, maxNativeCallArgs> args;
+    for (const ExprAST* arg : callExprAST->GetArgs()) {
+        if (!Evaluate(arg, args.emplace_back())) {
+            return false;
+        }
+    }
+    CallTarget target;
+    if (!resolveCall(callExprAST->GetCallee(), target)) {
+        return false;
+    }
+    if (target.definition) {
+        return Run(target.definition, args, result);
+    }
+    result = CallNative(target.address, args);
+    return true;
+}
+
+bool Interpreter::EvaluateForExpr(const ForExprAST* forExprAST)
+{
+    double start;
+    if (!Evaluate(forExprAST->GetStartExpr(), start)) {
+        return false;
+    }
+    variables.emplace_back(forExprAST->GetVarName(), start);
+    size_t slot = variables.size() - 1;
+    bool succeeded = false;
+    while (true) {
+        double end, body;
+        if (!Evaluate(forExprAST->GetEndExpr(), end)) {
+            break;
+        }
+        if (!IsTrue(end)) {
+            succeeded = true;
+            break;
+        }
+        if (!Evaluate(forExprAST->GetBodyExpr(), body)) {
+            break;
+        }
+        double step = 1.0;
+        if (forExprAST->GetStepExpr() && !Evaluate(forExprAST->GetStepExpr(), step)) {
+            break;
+        }
+        // The body may have grown the vector, so the variable is reached by index.
+        variables[slot].second += step;
+    }
+    variables.resize(slot);
+    return succeeded;
+}
+
+bool Interpreter::EvaluateVarExpr(const VarExprAST* varExprAST, double& result)
+{
+    size_t outerSize = variables.size();
+    bool succeeded = true;
+    for (const VarExprAST::Binding& binding : varExprAST->GetBindings()) {
+        double init = 0.0;
+        if (binding.init && !Evaluate(binding.init, init)) {
+            succeeded = false;
+            break;
+        }
+        variables.emplace_back(binding.name, init);
+    }
+    succeeded = succeeded && Evaluate(varExprAST->GetBodyExpr(), result);
+    variables.resize(outerSize);
+    return succeeded;
+}
+
+bool Interpreter::Evaluate(const ExprAST* exprAST, double& result)
+{
+    switch (exprAST->GetKind()) {
+        case ExprAST::Kind::Number:
+            result = cast<NumberExprAST>(exprAST)->GetValue();
+            return true;
+        case ExprAST::Kind::Variable: {
+            double* variable = LookupVariable(cast<VariableExprAST>(exprAST)->GetName());
+            if (!variable) {
+                return false;
+            }
+            result = *variable;
+            return true;
+        }
+        case ExprAST::Kind::Binary:
+            return EvaluateBinaryExpr(cast<BinaryExprAST>(exprAST), result);
+        case ExprAST::Kind::Call:
+            return EvaluateCallExpr(cast<CallExprAST>(exprAST), result);
+        case ExprAST::Kind::If: {
+            auto ifExprAST = cast<IfExprAST>(exprAST);
+            double condition;
+            if (!Evaluate(ifExprAST->GetCondtionExpr(), condition)) {
+                return false;
+            }
+            return Evaluate(IsTrue(condition) ? ifExprAST->GetThenExpr() : ifExprAST->GetElseExpr(), result);
+        }
+        case ExprAST::Kind::For:
+            result = 0.0;
+            return EvaluateForExpr(cast<ForExprAST>(exprAST));
+        case ExprAST::Kind::Var:
+            return EvaluateVarExpr(cast<VarExprAST>(exprAST), result);
+    }
+    return false;
+}
+
+bool Interpreter::Run(const FunctionAST* function, ArrayRef<double> args, double& result)
+{
+    size_t callerBase = frameBase;
+    frameBase = variables.size();
+    ArrayRef<StringRef> names = function->GetPrototype()->GetArgs();
+    for (size_t i = 0; i < names.size(); i++) {
+        variables.emplace_back(names[i], args[i]);
+    }
+    bool succeeded = Evaluate(function->GetBody(), result);
+    variables.resize(frameBase);
+    frameBase = callerBase;
+    return succeeded;
+}
@@ -1,125 +1,200 @@
 #include "Lexer.h"
 
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <unordered_map>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "llvm/ADT/SmallVector.h"
 
 #include "AST.h"
 
-static std::string IdentifierStr;
-static double NumVal;
-static int currentToken;
-static std::unordered_map<char, int> binopPrecedence = {
+static const std::unordered_map<char, int> binopPrecedence = {
+    {'=', 2},
     {'<', 10},
     {'+', 20},
     {'-', 20},
     {'*', 40},
 };
 
-int GetCurrentToken()
+static constexpr size_t stdinChunkSize = 64 * 1024;
+
+Lexer::Lexer() : fromStdin(true) { }
+
+Lexer::Lexer(std::string_view source, unsigned firstLine)
+    : fromStdin(false), inputCur(source.data()), inputEnd(source.data() + source.size()), line(firstLine),
+      tokenLine(firstLine) { }
+
+// Makes sure there is at least one unread character. Returns false at end of input.
+bool Lexer::FillInput()
+{
+    if (inputCur != inputEnd) {
+        return true;
+    }
+    if (!fromStdin || stdinExhausted) {
+        return false;
+    }
+    size_t keep = tokenStart ? inputEnd - tokenStart : 0;
+    if (keep + stdinChunkSize > stdinBuffer.size()) {
+        std::vector<char> grown(keep + stdinChunkSize);
+        std::memcpy(grown.data(), tokenStart, keep);
+        stdinBuffer.swap(grown);
+    } else if (keep != 0) {
+        std::memmove(stdinBuffer.data(), tokenStart, keep);
+    }
+    ssize_t count;
+    do {
+        count = read(STDIN_FILENO, stdinBuffer.data() + keep, stdinChunkSize);
+    } while (count < 0 && errno == EINTR);
+    tokenStart = stdinBuffer.data();
+    inputCur = tokenStart + keep;
+    inputEnd = inputCur + (count > 0 ? count : 0);
+    if (count <= 0) {
+        stdinExhausted = true;
+        return false;
+    }
+    return true;
+}
+
+int Lexer::PeekChar() const
 {
-    return currentToken;
+    return static_cast<unsigned char>(*inputCur);
 }
 
-static int GetTokPrecendence()
+int Parser::GetTokPrecendence() const
 {
     if (!isascii(currentToken)) {
         return -1;
     }
 
-    int tokPrec = binopPrecedence[currentToken];
-    if (tokPrec <= 0) {
+    auto iter = binopPrecedence.find(currentToken);
+    if (iter == binopPrecedence.end() || iter->second <= 0) {
         return -1;
     }
 
-    return tokPrec;
+    return iter->second;
 }
 
-static int gettok() {
-    static int LastChar = ' ';
-
-    while (isspace(LastChar)) {
-        LastChar = getchar();
+static int LookupKeyword(std::string_view identifier)
+{
+    switch (identifier.size()) {
+        case 2:
+            if (identifier == "if") {
+                return tok_if;
+            }
+            if (identifier == "in") {
+                return tok_in;
+            }
+            break;
+        case 3:
+            if (identifier == "def") {
+                return tok_def;
+            }
+            if (identifier == "for") {
+                return tok_for;
+            }
+            if (identifier == "var") {
+                return tok_var;
+            }
+            break;
+        case 4:
+            if (identifier == "then") {
+                return tok_then;
+            }
+            if (identifier == "else") {
+                return tok_else;
+            }
+            if (identifier == "memo") {
+                return tok_memo;
+            }
+            break;
+        case 6:
+            if (identifier == "extern") {
+                return tok_extern;
+            }
+            break;
     }
+    return tok_identifier;
+}
 
-    if (isalpha(LastChar)) {
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar()))) {
-            IdentifierStr += LastChar;
-        }
-
-        if (IdentifierStr == "def") {
-            return tok_def;
-        }
-        if (IdentifierStr == "extern") {
-            return tok_extern;
-        }
-        if (IdentifierStr == "if") {
-            return tok_if;
-        }
-        if (IdentifierStr == "then") {
-            return tok_then;
+int Lexer::GetToken() {
+    while (true) {
+        tokenStart = inputCur;
+        if (!FillInput()) {
+            return tok_eof;
         }
-        if (IdentifierStr == "else") {
-            return tok_else;
+        if (isspace(PeekChar())) {
+            line += PeekChar() == '\n';
+            ++inputCur;
+        } else if (PeekChar() == '#') {
+            while (FillInput() && PeekChar() != '\n' && PeekChar() != '\r') {
+                tokenStart = ++inputCur;
+            }
+        } else {
+            break;
         }
-        return tok_identifier;
     }
+    tokenLine = line;
 
-    if (isdigit(LastChar) || LastChar == '.') {
-        std::string NumStr;
+    if (isalpha(PeekChar())) {
         do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
+            ++inputCur;
+        } while (FillInput() && isalnum(PeekChar()));
 
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
+        identifierStr = std::string_view(tokenStart, inputCur - tokenStart);
+        return LookupKeyword(identifierStr);
     }
 
-    if (LastChar == '#') {
+    if (isdigit(PeekChar()) || PeekChar() == '.') {
         do {
-            LastChar = getchar();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+            ++inputCur;
+        } while (FillInput() && (isdigit(PeekChar()) || PeekChar() == '.'));
 
-        if (LastChar != EOF) {
-            return gettok();
+        // Like strtod, only the longest valid prefix is converted, and a lone '.' reads as 0.
+        if (std::from_chars(tokenStart, inputCur, numVal).ec != std::errc()) {
+            numVal = 0;
         }
+        return tok_number;
     }
 
-    if (LastChar == EOF) {
-        return tok_eof;
-    }
-
-    int thisChar = LastChar;
-    LastChar = getchar();
+    int thisChar = PeekChar();
+    ++inputCur;
     return thisChar;
 }
 
-int GetNextToken() {
-    return currentToken = gettok();
+int Parser::GetNextToken() {
+    return currentToken = lexer.GetToken();
 }
 
-std::unique_ptr<ExprAST> LogError(const char* str) {
+ExprAST* LogError(const char* str) {
     fprintf(stderr, "Error: %s\n", str);
     return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char* str) {
+PrototypeAST* LogErrorP(const char* str) {
     LogError(str);
     return nullptr;
 }
 
-std::unique_ptr<ExprAST> ParseExpression();
-
-static std::unique_ptr<ExprAST> ParseNumberExpr()
+ExprAST* Parser::ParseNumberExpr()
 {
-    auto result = std::make_unique<NumberExprAST>(NumVal);
+    auto result = context->Create<NumberExprAST>(lexer.GetNumber());
+    result->SetLine(lexer.GetLine());
     GetNextToken(); // Consume the number
-    return std::move(result);
+    return result;
 }
 
-static std::unique_ptr<ExprAST> ParseParenthesisExpr()
+ExprAST* Parser::ParseParenthesisExpr()
 {
     GetNextToken(); // Consume '('
     auto v = ParseExpression();
@@ -133,19 +208,22 @@ static std::unique_ptr<ExprAST> ParseParenthesisExpr()
     return v;
 }
 
-static std::unique_ptr<ExprAST> ParseIdentifierExpr()
+ExprAST* Parser::ParseIdentifierExpr()
 {
-    std::string idName = IdentifierStr;
+    llvm::StringRef idName = context->Intern(lexer.GetIdentifier());
+    unsigned line = lexer.GetLine();
     GetNextToken(); // Consume identifier
     if (currentToken != '(') {
-        return std::make_unique<VariableExprAST>(idName);
+        auto result = context->Create<VariableExprAST>(idName);
+        result->SetLine(line);
+        return result;
     }
     GetNextToken();
-    std::vector<std::unique_ptr<ExprAST>> args;
+    llvm::SmallVector<ExprAST*, 8> args;
     if (currentToken != ')') {
         while(true) {
             if (auto arg = ParseExpression()) {
-                args.push_back(std::move(arg));
+                args.push_back(arg);
             } else {
                 return nullptr;
             }
@@ -164,11 +242,14 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr()
 
     GetNextToken(); // Consume ')'
 
-    return std::make_unique<CallExprAST>(idName, std::move(args));
+    auto result = context->Create<CallExprAST>(idName, context->CopyArray<ExprAST*>(args));
+    result->SetLine(line);
+    return result;
 }
 
-std::unique_ptr<ExprAST> ParseIfExpr()
+ExprAST* Parser::ParseIfExpr()
 {
+    unsigned line = lexer.GetLine();
     GetNextToken();
 
     auto condExpr = ParseExpression();
@@ -195,10 +276,109 @@ std::unique_ptr<ExprAST> ParseIfExpr()
         return nullptr;
     }
 
-    return std::make_unique<IfExprAST>(std::move(condExpr), std::move(thenExpr), std::move(elseExpr));
+    auto result = context->Create<IfExprAST>(condExpr, thenExpr, elseExpr);
+    result->SetLine(line);
+    return result;
+}
+
+ExprAST* Parser::ParseForExpr()
+{
+    unsigned line = lexer.GetLine();
+    GetNextToken(); // Consume 'for'
+    if (currentToken != tok_identifier) {
+        return LogError("Expected identifier after for");
+    }
+    llvm::StringRef varName = context->Intern(lexer.GetIdentifier());
+    GetNextToken();
+    if (currentToken != '=') {
+        return LogError("Expected '=' after for");
+    }
+    GetNextToken();
+
+    auto startExpr = ParseExpression();
+    if (!startExpr) {
+        return nullptr;
+    }
+    if (currentToken != ',') {
+        return LogError("Expected ',' after for start value");
+    }
+    GetNextToken();
+
+    auto endExpr = ParseExpression();
+    if (!endExpr) {
+        return nullptr;
+    }
+
+    ExprAST* stepExpr = nullptr;
+    if (currentToken == ',') {
+        GetNextToken();
+        stepExpr = ParseExpression();
+        if (!stepExpr) {
+            return nullptr;
+        }
+    }
+
+    if (currentToken != tok_in) {
+        return LogError("Expected 'in' after for");
+    }
+    GetNextToken();
+
+    auto bodyExpr = ParseExpression();
+    if (!bodyExpr) {
+        return nullptr;
+    }
+
+    auto result = context->Create<ForExprAST>(varName, startExpr, endExpr, stepExpr, bodyExpr);
+    result->SetLine(line);
+    return result;
+}
+
+ExprAST* Parser::ParseVarExpr()
+{
+    unsigned line = lexer.GetLine();
+    GetNextToken(); // Consume 'var'
+    if (currentToken != tok_identifier) {
+        return LogError("Expected identifier after var");
+    }
+    llvm::SmallVector<VarExprAST::Binding, 4> bindings;
+    while (true) {
+        llvm::StringRef name = context->Intern(lexer.GetIdentifier());
+        GetNextToken();
+        ExprAST* init = nullptr;
+        if (currentToken == '=') {
+            GetNextToken();
+            init = ParseExpression();
+            if (!init) {
+                return nullptr;
+            }
+        }
+        bindings.push_back({ name, init });
+
+        if (currentToken != ',') {
+            break;
+        }
+        GetNextToken();
+        if (currentToken != tok_identifier) {
+            return LogError("Expected identifier list after var");
+        }
+    }
+
+    if (currentToken != tok_in) {
+        return LogError("Expected 'in' after var");
+    }
+    GetNextToken();
+
+    auto bodyExpr = ParseExpression();
+    if (!bodyExpr) {
+        return nullptr;
+    }
+
+    auto result = context->Create<VarExprAST>(context->CopyArray<VarExprAST::Binding>(bindings), bodyExpr);
+    result->SetLine(line);
+    return result;
 }
 
-static std::unique_ptr<ExprAST> ParsePrimary()
+ExprAST* Parser::ParsePrimary()
 {
     switch (currentToken) {
         case tok_identifier:
@@ -209,12 +389,16 @@ static std::unique_ptr<ExprAST> ParsePrimary()
             return ParseParenthesisExpr();
         case tok_if:
             return ParseIfExpr();
+        case tok_for:
+            return ParseForExpr();
+        case tok_var:
+            return ParseVarExpr();
         default:
             return LogError("unknown token when expecting an expression");    
     }
 }
 
-std::unique_ptr<ExprAST> ParseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> LHS)
+ExprAST* Parser::ParseBinOpRHS(int exprPrec, ExprAST* LHS)
 {
     while (true) {
         int tokPrec = GetTokPrecendence();
@@ -224,6 +408,7 @@ std::unique_ptr<ExprAST> ParseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> LH
         }
 
         int binOp = currentToken; // Current binary operator
+        unsigned line = lexer.GetLine();
         GetNextToken();
 
         auto RHS = ParsePrimary();
@@ -233,42 +418,49 @@ std::unique_ptr<ExprAST> ParseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> LH
 
         int nextPrec = GetTokPrecendence(); // Get next binary operator, or -1 if it's not a binary operator
         if (tokPrec < nextPrec) {
-            RHS = ParseBinOpRHS(tokPrec + 1, std::move(RHS));
+            RHS = ParseBinOpRHS(tokPrec + 1, RHS);
             if (!RHS) {
                 return nullptr;
             }
         }
 
-        LHS = std::make_unique<BinaryExprAST>(binOp, std::move(LHS), std::move(RHS));
+        LHS = context->Create<BinaryExprAST>(binOp, LHS, RHS);
+        LHS->SetLine(line);
     }    
 }
 
-std::unique_ptr<PrototypeAST> ParsePrototype()
+PrototypeAST* Parser::ParsePrototype(bool isExtern)
 {
     if (currentToken != tok_identifier) {
         return LogErrorP("Expected function name in prototype");
     }
 
-    std::string fnName = IdentifierStr;
+    llvm::StringRef fnName = context->Intern(lexer.GetIdentifier());
+    unsigned line = lexer.GetLine();
     GetNextToken();
 
     if (currentToken != '(') {
         LogErrorP("Expected '(' in prototype");
     }
 
-    std::vector<std::string> argNames;
+    llvm::SmallVector<llvm::StringRef, 8> argNames;
     while (GetNextToken() == tok_identifier) {
-        argNames.push_back(IdentifierStr);
+        argNames.push_back(context->Intern(lexer.GetIdentifier()));
     }
     if (currentToken != ')') {
         LogErrorP("Expected ')' in prototype");
     }
     GetNextToken();
-    return std::make_unique<PrototypeAST>(fnName, std::move(argNames));
+    return context->Create<PrototypeAST>(fnName, context->CopyArray<llvm::StringRef>(argNames), line, isExtern);
 }
 
-std::unique_ptr<FunctionAST> ParseDefinition()
+FunctionAST* Parser::ParseDefinition()
 {
+    bool memoized = currentToken == tok_memo;
+    if (memoized && GetNextToken() != tok_def) {
+        LogError("Expected 'def' after 'memo'");
+        return nullptr;
+    }
     GetNextToken(); // Consume 'def' keyword
     auto proto = ParsePrototype();
     if (!proto) {
@@ -276,31 +468,213 @@ std::unique_ptr<FunctionAST> ParseDefinition()
     }
 
     if (auto exp = ParseExpression()) {
-        return std::make_unique<FunctionAST>(std::move(proto), std::move(exp));
+        return context->Create<FunctionAST>(proto, exp, memoized);
     }
     return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> ParseExtern()
+PrototypeAST* Parser::ParseExtern()
 {
-    GetNextToken(); // Consume 'def' keyword
-    return ParsePrototype();
+    GetNextToken(); // Consume 'extern' keyword
+    return ParsePrototype(/*isExtern=*/true);
 }
 
-std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+FunctionAST* Parser::ParseTopLevelExpr()
 {
+    unsigned line = lexer.GetLine();
     if (auto e = ParseExpression()) {
-        auto proto = std::make_unique<PrototypeAST>("__anonymours_expr", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
+        auto proto = context->Create<PrototypeAST>(context->Intern("__anonymours_expr"), llvm::ArrayRef<llvm::StringRef>(),
+            line);
+        return context->Create<FunctionAST>(proto, e);
     }
     return nullptr;
 }
 
-std::unique_ptr<ExprAST> ParseExpression() {
+bool Parser::ParseCommand(ReplCommand& command)
+{
+    GetNextToken(); // Consume ':'
+    if (currentToken == tok_memo) {
+        command.kind = ReplCommand::Memo;
+    } else if (currentToken == tok_identifier && lexer.GetIdentifier() == "map") {
+        command.kind = ReplCommand::Map;
+    } else {
+        LogError("Unknown command, expected :map or :memo");
+        return false;
+    }
+    GetNextToken();
+    if (currentToken != tok_identifier) {
+        LogError("Expected function name after command");
+        return false;
+    }
+    command.function = std::string(lexer.GetIdentifier());
+    command.inputs.clear();
+    GetNextToken();
+    if (command.kind == ReplCommand::Memo) {
+        return true;
+    }
+    while (currentToken == '[') {
+        GetNextToken();
+        std::vector<double> values;
+        while (currentToken != ']') {
+            double sign = 1;
+            if (currentToken == '-') {
+                sign = -1;
+                GetNextToken();
+            }
+            if (currentToken != tok_number) {
+                LogError("Expected a number in list");
+                return false;
+            }
+            values.push_back(sign * lexer.GetNumber());
+            GetNextToken();
+            if (currentToken == ',') {
+                GetNextToken();
+            } else if (currentToken != ']') {
+                LogError("Expected ',' or ']' in list");
+                return false;
+            }
+        }
+        GetNextToken(); // Consume ']'
+        command.inputs.push_back(std::move(values));
+    }
+    return true;
+}
+
+ExprAST* Parser::ParseExpression() {
     auto LHS = ParsePrimary();
     if (!LHS) {
         return nullptr;
     }
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
+}
+
+// Whether the word before pos, skipping whitespace, is "memo".
+static bool FollowsMemo(std::string_view source, size_t pos)
+{
+    while (pos > 0 && isspace(static_cast<unsigned char>(source[pos - 1]))) {
+        --pos;
+    }
+    return pos >= 4 && source.substr(pos - 4, 4) == "memo" &&
+        (pos == 4 || !isalnum(static_cast<unsigned char>(source[pos - 5])));
+}
+
+// Returns the offset of the first def/extern keyword at or after `from`, or the end of the source.
+// These keywords only ever start a top-level item, so the source can be split right before them,
+// or before the "memo" of "memo def".
+static size_t FindItemBoundary(std::string_view source, size_t from)
+{
+    // Tokens and comments never span lines, so scanning from the start of the line is safe.
+    size_t lineEnd = source.find_last_of("\n\r", from);
+    size_t pos = lineEnd == std::string_view::npos ? 0 : lineEnd + 1;
+    // Start of the "memo" keyword right before the current word, if any. A "def" following a "memo"
+    // on an earlier line is not a boundary.
+    size_t memoStart = std::string_view::npos;
+    while (pos < source.size()) {
+        int c = static_cast<unsigned char>(source[pos]);
+        if (c == '#') {
+            pos = source.find_first_of("\n\r", pos);
+            if (pos == std::string_view::npos) {
+                break;
+            }
+        } else if (isalpha(c)) {
+            size_t start = pos;
+            while (pos < source.size() && isalnum(static_cast<unsigned char>(source[pos]))) {
+                ++pos;
+            }
+            std::string_view word = source.substr(start, pos - start);
+            if (word == "def" || word == "extern") {
+                size_t itemStart = word == "def" && memoStart != std::string_view::npos ? memoStart : start;
+                bool split = memoStart != std::string_view::npos || word != "def" || !FollowsMemo(source, start);
+                if (split && itemStart >= from) {
+                    return itemStart;
+                }
+            }
+            memoStart = word == "memo" ? start : std::string_view::npos;
+        } else {
+            if (!isspace(c)) {
+                memoStart = std::string_view::npos;
+            }
+            ++pos;
+        }
+    }
+    return source.size();
+}
+
+static void ParseItems(std::string_view source, unsigned firstLine, ASTContext& context,
+    std::vector<TopLevelItem>& items)
+{
+    Parser parser(source, context, firstLine);
+    parser.GetNextToken();
+    while (true) {
+        switch (parser.GetCurrentToken()) {
+            case tok_eof:
+                return;
+            case ';':
+                parser.GetNextToken();
+                break;
+            case tok_def:
+            case tok_memo:
+                if (auto def = parser.ParseDefinition()) {
+                    items.push_back({ TopLevelItem::Definition, def, nullptr });
+                } else {
+                    items.push_back({ TopLevelItem::Definition, nullptr, nullptr });
+                    parser.GetNextToken(); // Skip the offending token for error recovery
+                }
+                break;
+            case tok_extern:
+                if (auto proto = parser.ParseExtern()) {
+                    items.push_back({ TopLevelItem::Extern, nullptr, proto });
+                } else {
+                    items.push_back({ TopLevelItem::Extern, nullptr, nullptr });
+                    parser.GetNextToken();
+                }
+                break;
+            default:
+                if (auto expr = parser.ParseTopLevelExpr()) {
+                    items.push_back({ TopLevelItem::Expression, expr, nullptr });
+                } else {
+                    items.push_back({ TopLevelItem::Expression, nullptr, nullptr });
+                    parser.GetNextToken();
+                }
+                break;
+        }
+    }
+}
+
+std::vector<TopLevelItem> ParseSource(std::string_view source, unsigned threadCount,
+    std::vector<std::unique_ptr<ASTContext>>& contexts)
+{
+    threadCount = std::max(threadCount, 1u);
+    std::vector<std::string_view> pieces;
+    std::vector<unsigned> firstLines = { 1 };
+    size_t begin = 0;
+    for (unsigned i = 1; i < threadCount && begin < source.size(); i++) {
+        size_t end = FindItemBoundary(source, std::max(begin + 1, source.size() / threadCount * i));
+        pieces.push_back(source.substr(begin, end - begin));
+        firstLines.push_back(firstLines.back() + std::count(pieces.back().begin(), pieces.back().end(), '\n'));
+        begin = end;
+    }
+    pieces.push_back(source.substr(begin));
+
+    std::vector<std::vector<TopLevelItem>> results(pieces.size());
+    size_t firstContext = contexts.size();
+    for (size_t i = 0; i < pieces.size(); i++) {
+        contexts.push_back(std::make_unique<ASTContext>());
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < pieces.size(); i++) {
+        workers.emplace_back(ParseItems, pieces[i], firstLines[i], std::ref(*contexts[firstContext + i]),
+            std::ref(results[i]));
+    }
+    ParseItems(pieces[0], firstLines[0], *contexts[firstContext], results[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<TopLevelItem> items = std::move(results[0]);
+    for (size_t i = 1; i < results.size(); i++) {
+        std::move(results[i].begin(), results[i].end(), std::back_inserter(items));
+    }
+    return items;
 }
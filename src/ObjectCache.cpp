@@ -0,0 +1,76 @@
+#include "ObjectCache.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+DiskObjectCache::DiskObjectCache(std::string directory, std::string configuration)
+    : directory(std::move(directory)), configuration(std::move(configuration) + ";LLVM " LLVM_VERSION_STRING)
+{
+}
+
+std::string DiskObjectCache::ComputeKey(const Module* module) const
+{
+    SmallVector<char, 0> bitcode;
+    raw_svector_ostream stream(bitcode);
+    WriteBitcodeToFile(*module, stream);
+    SHA1 hasher;
+    hasher.update(configuration);
+    hasher.update(StringRef(bitcode.data(), bitcode.size()));
+    return toHex(hasher.final(), /*LowerCase=*/true);
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module* module)
+{
+    std::string key = ComputeKey(module);
+    SmallString<128> path(directory);
+    sys::path::append(path, key + ".o");
+    auto buffer = MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (buffer) {
+        return std::move(*buffer);
+    }
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pendingKeys[module] = std::move(key);
+    return nullptr;
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module* module, MemoryBufferRef object)
+{
+    std::string key;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto iter = pendingKeys.find(module);
+        if (iter == pendingKeys.end()) {
+            return;
+        }
+        key = std::move(iter->second);
+        pendingKeys.erase(iter);
+    }
+    // The object is written under a temporary name and renamed into place, so a process starting
+    // at the same time never maps a partial file. A failed write only costs a recompile later.
+    SmallString<128> tempModel(directory);
+    sys::path::append(tempModel, key + "-%%%%%%.tmp");
+    SmallString<128> tempPath;
+    int fd;
+    if (sys::fs::createUniqueFile(tempModel, fd, tempPath)) {
+        return;
+    }
+    raw_fd_ostream out(fd, /*shouldClose=*/true);
+    out << object.getBuffer();
+    out.close();
+    SmallString<128> path(directory);
+    sys::path::append(path, key + ".o");
+    if (out.has_error() || sys::fs::rename(tempPath, path)) {
+        out.clear_error();
+        sys::fs::remove(tempPath);
+    }
+}
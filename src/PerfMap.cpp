@@ -0,0 +1,56 @@
+#include "PerfMap.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+#include "llvm/Object/SymbolSize.h"
+
+using namespace llvm;
+
+std::unique_ptr<PerfMapListener> PerfMapListener::Create()
+{
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+    return std::unique_ptr<PerfMapListener>(new PerfMapListener(file));
+}
+
+PerfMapListener::~PerfMapListener()
+{
+    fclose(file);
+}
+
+void PerfMapListener::notifyObjectLoaded(ObjectKey, const object::ObjectFile& object,
+    const RuntimeDyld::LoadedObjectInfo& info)
+{
+    // The debug copy of the object has its symbols at the addresses they were loaded to.
+    object::OwningBinary<object::ObjectFile> debugObject = info.getObjectForDebug(object);
+    if (!debugObject.getBinary()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(fileMutex);
+    for (const auto& [symbol, size] : object::computeSymbolSizes(*debugObject.getBinary())) {
+        Expected<object::SymbolRef::Type> type = symbol.getType();
+        if (!type || *type != object::SymbolRef::ST_Function) {
+            consumeError(type.takeError());
+            continue;
+        }
+        Expected<StringRef> name = symbol.getName();
+        Expected<uint64_t> address = symbol.getAddress();
+        if (!name || !address || size == 0) {
+            consumeError(name.takeError());
+            consumeError(address.takeError());
+            continue;
+        }
+        fprintf(file, "%llx %llx %.*s\n", static_cast<unsigned long long>(*address),
+            static_cast<unsigned long long>(size), static_cast<int>(name->size()), name->data());
+    }
+    // perf reads the map once the process has exited, which may be by a crash.
+    fflush(file);
+}
@@ -0,0 +1,217 @@
+#include "PhaseTimings.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+using Clock = std::chrono::steady_clock;
+
+static const char* const phaseNames[phaseCount] = { "parse", "codegen", "optimize", "jit", "execute" };
+
+// Null while timing is off.
+static raw_ostream* timingsOut = nullptr;
+static std::unique_ptr<raw_fd_ostream> timingsFile;
+static bool printStatistics = false;
+static PhaseTimes sessionTimes;
+static size_t itemCount = 0;
+// Items are reported from background threads too.
+static std::mutex reportMutex;
+
+struct PassTime {
+    double milliseconds = 0;
+    size_t runs = 0;
+};
+// Time spent in each pass and analysis itself, not counting the passes and analyses it runs.
+// Pipelines run on several threads at once.
+static StringMap<PassTime> passTimes;
+static std::mutex passTimesMutex;
+// Passes and analyses running on this thread, innermost last, with the time each was resumed.
+static thread_local std::vector<std::pair<StringRef, Clock::time_point>> runningPasses;
+
+PhaseTimes& PhaseTimes::operator+=(const PhaseTimes& other)
+{
+    for (size_t i = 0; i < phaseCount; i++) {
+        milliseconds[i] += other.milliseconds[i];
+    }
+    return *this;
+}
+
+bool EnablePhaseTimings(const std::string& outputPath, bool statistics)
+{
+    if (outputPath.empty()) {
+        timingsOut = &errs();
+    } else {
+        std::error_code error;
+        timingsFile = std::make_unique<raw_fd_ostream>(outputPath, error, sys::fs::OF_Text);
+        if (error) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", outputPath.c_str(), error.message().c_str());
+            timingsFile.reset();
+            return false;
+        }
+        timingsOut = timingsFile.get();
+    }
+    // Statistics are only collected by LLVM builds with assertions or LLVM_FORCE_ENABLE_STATS.
+    printStatistics = statistics;
+    if (statistics) {
+        EnableStatistics(/*DoPrintOnExit=*/false);
+    }
+    return true;
+}
+
+bool PhaseTimingsEnabled()
+{
+    return timingsOut != nullptr;
+}
+
+PhaseTimer::PhaseTimer(PhaseTimes& times, Phase phase)
+{
+    if (timingsOut) {
+        target = &times.milliseconds[static_cast<size_t>(phase)];
+        start = Clock::now();
+    }
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    if (target) {
+        *target += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+}
+
+static void AddPassTime(StringRef name, Clock::time_point start, Clock::time_point end, bool finished)
+{
+    std::lock_guard<std::mutex> lock(passTimesMutex);
+    PassTime& time = passTimes[name];
+    time.milliseconds += std::chrono::duration<double, std::milli>(end - start).count();
+    time.runs += finished;
+}
+
+static void StartPass(StringRef name)
+{
+    auto now = Clock::now();
+    if (!runningPasses.empty()) {
+        AddPassTime(runningPasses.back().first, runningPasses.back().second, now, false);
+    }
+    runningPasses.emplace_back(name, now);
+}
+
+static void StopPass()
+{
+    if (runningPasses.empty()) {
+        return;
+    }
+    auto now = Clock::now();
+    AddPassTime(runningPasses.back().first, runningPasses.back().second, now, true);
+    runningPasses.pop_back();
+    if (!runningPasses.empty()) {
+        runningPasses.back().second = now;
+    }
+}
+
+void RegisterPassTimers(PassInstrumentationCallbacks& pic)
+{
+    pic.registerBeforeNonSkippedPassCallback([](StringRef name, Any) { StartPass(name); });
+    pic.registerAfterPassCallback([](StringRef, Any, const PreservedAnalyses&) { StopPass(); });
+    pic.registerAfterPassInvalidatedCallback([](StringRef, const PreservedAnalyses&) { StopPass(); });
+    pic.registerBeforeAnalysisCallback([](StringRef name, Any) { StartPass(name); });
+    pic.registerAfterAnalysisCallback([](StringRef, Any) { StopPass(); });
+}
+
+// Reports are in whole microseconds, which keeps them short and exact.
+static int64_t Microseconds(double milliseconds)
+{
+    return static_cast<int64_t>(milliseconds * 1000 + 0.5);
+}
+
+static void WritePhaseTimes(json::OStream& out, const PhaseTimes& times)
+{
+    out.attributeObject("us", [&] {
+        for (size_t i = 0; i < phaseCount; i++) {
+            out.attribute(phaseNames[i], Microseconds(times.milliseconds[i]));
+        }
+    });
+}
+
+void ReportItemTimes(StringRef kind, ArrayRef<std::string> names, PhaseTimes& times)
+{
+    if (!timingsOut) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(reportMutex);
+    sessionTimes += times;
+    itemCount++;
+    json::OStream out(*timingsOut);
+    out.object([&] {
+        out.attribute("item", static_cast<int64_t>(itemCount));
+        out.attribute("kind", kind);
+        out.attributeArray("names", [&] {
+            for (const std::string& name : names) {
+                out.value(name);
+            }
+        });
+        WritePhaseTimes(out, times);
+    });
+    *timingsOut << "\n";
+    timingsOut->flush();
+    times = PhaseTimes();
+}
+
+void ReportSessionTimes()
+{
+    if (!timingsOut) {
+        return;
+    }
+    std::lock_guard<std::mutex> reportLock(reportMutex);
+    std::vector<std::pair<std::string, PassTime>> passes;
+    {
+        std::lock_guard<std::mutex> lock(passTimesMutex);
+        for (auto& entry : passTimes) {
+            passes.emplace_back(entry.getKey().str(), entry.getValue());
+        }
+    }
+    std::sort(passes.begin(), passes.end(), [](const auto& a, const auto& b) {
+        return a.second.milliseconds > b.second.milliseconds;
+    });
+    json::OStream out(*timingsOut);
+    out.object([&] {
+        out.attributeObject("session", [&] {
+            out.attribute("items", static_cast<int64_t>(itemCount));
+            WritePhaseTimes(out, sessionTimes);
+            out.attributeArray("passes", [&] {
+                for (auto& [name, time] : passes) {
+                    out.object([&] {
+                        out.attribute("name", name);
+                        out.attribute("us", Microseconds(time.milliseconds));
+                        out.attribute("runs", static_cast<int64_t>(time.runs));
+                    });
+                }
+            });
+            if (printStatistics) {
+                // Printed over several lines, while every report takes one.
+                std::string statistics;
+                raw_string_ostream statisticsOut(statistics);
+                PrintStatisticsJSON(statisticsOut);
+                statisticsOut.flush();
+                std::replace(statistics.begin(), statistics.end(), '\n', ' ');
+                out.attributeBegin("statistics");
+                out.rawValue(statistics);
+                out.attributeEnd();
+            }
+        });
+    });
+    *timingsOut << "\n";
+    timingsOut->flush();
+}
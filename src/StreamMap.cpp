@@ -0,0 +1,360 @@
+#include "StreamMap.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+
+using namespace llvm;
+
+// Bytes of input evaluated by one thread at a time. A chunk takes far longer to evaluate than to
+// hand out, and a round of chunks for every thread still fits comfortably in memory.
+static constexpr size_t chunkSize = 4 << 20;
+
+// A run of whole rows, and what became of them.
+struct Chunk {
+    std::string_view input;
+    // Input read from a stream. Chunks of a mapped file point into the mapping instead.
+    std::vector<char> storage;
+    // Kept between rounds so their memory is reused.
+    std::vector<std::vector<double>> columns;
+    std::vector<double> results;
+    std::string output;
+    // Rows of the chunk. For text every line counts, so errors can name the line.
+    size_t rows = 0;
+    // Set for the first malformed row, with its index in the chunk.
+    std::string error;
+    size_t errorRow = 0;
+};
+
+// Where the rows come from: a mapped regular file, or anything else read as a stream.
+struct InputSource {
+    std::unique_ptr<MemoryBuffer> file;
+    size_t fileOffset = 0;
+    // End of the pages of the mapping already given back to the system.
+    uintptr_t releasedEnd = 0;
+    int fd = -1;
+    bool ownsFd = false;
+    // Bytes read past the last whole row.
+    std::vector<char> pending;
+    bool ended = false;
+    bool failed = false;
+    bool binary = false;
+    size_t rowSize = 0;
+
+    ~InputSource()
+    {
+        if (ownsFd) {
+            close(fd);
+        }
+    }
+};
+
+static bool OpenInput(InputSource& source, const StreamMapOptions& options, size_t argCount)
+{
+    source.binary = options.binary;
+    source.rowSize = argCount * sizeof(double);
+    if (options.inputFile.empty() || options.inputFile == "-") {
+        source.fd = STDIN_FILENO;
+        return true;
+    }
+    sys::fs::file_status status;
+    if (std::error_code error = sys::fs::status(options.inputFile, status)) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", options.inputFile.c_str(), error.message().c_str());
+        return false;
+    }
+    // Pipes and devices cannot be mapped, and reading them whole would not bound memory.
+    if (status.type() != sys::fs::file_type::regular_file) {
+        source.fd = open(options.inputFile.c_str(), O_RDONLY);
+        if (source.fd < 0) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", options.inputFile.c_str(), strerror(errno));
+            return false;
+        }
+        source.ownsFd = true;
+        return true;
+    }
+    auto buffer = MemoryBuffer::getFile(options.inputFile, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", options.inputFile.c_str(),
+            buffer.getError().message().c_str());
+        return false;
+    }
+    source.file = std::move(*buffer);
+    if (source.file->getBufferKind() == MemoryBuffer::MemoryBuffer_MMap) {
+        uintptr_t pageSize = sys::Process::getPageSizeEstimate();
+        uintptr_t start = reinterpret_cast<uintptr_t>(source.file->getBufferStart());
+        source.releasedEnd = (start + pageSize - 1) & ~(pageSize - 1);
+        uintptr_t end = reinterpret_cast<uintptr_t>(source.file->getBufferEnd()) & ~(pageSize - 1);
+        if (end > source.releasedEnd) {
+            madvise(reinterpret_cast<void*>(source.releasedEnd), end - source.releasedEnd, MADV_SEQUENTIAL);
+        }
+    }
+    return true;
+}
+
+// Length of the longest prefix of data that holds only whole rows and is not much longer than a
+// chunk. A line longer than a chunk gets a chunk of its own. Zero if data holds no whole row.
+static size_t WholeRowsLength(std::string_view data, const InputSource& source)
+{
+    if (source.binary) {
+        if (data.size() < source.rowSize) {
+            return 0;
+        }
+        return std::max(std::min(data.size(), chunkSize) / source.rowSize, size_t(1)) * source.rowSize;
+    }
+    if (data.empty()) {
+        return 0;
+    }
+    size_t end = data.rfind('\n', std::min(data.size(), chunkSize) - 1);
+    if (end == std::string_view::npos) {
+        end = data.find('\n', chunkSize);
+    }
+    return end == std::string_view::npos ? 0 : end + 1;
+}
+
+// Fills chunk with the next rows. Returns false at the end of the input, or on a read error,
+// which sets source.failed.
+static bool ReadChunk(InputSource& source, Chunk& chunk)
+{
+    chunk.rows = 0;
+    chunk.error.clear();
+    if (source.file) {
+        std::string_view rest = source.file->getBuffer().substr(source.fileOffset);
+        size_t length = WholeRowsLength(rest, source);
+        // The last line may lack its newline; a partial binary row is reported by the evaluation.
+        if (length == 0) {
+            length = rest.size();
+        }
+        chunk.input = rest.substr(0, length);
+        source.fileOffset += length;
+        return length != 0;
+    }
+
+    std::vector<char>& data = chunk.storage;
+    data.swap(source.pending);
+    source.pending.clear();
+    while (!source.ended) {
+        if (data.size() >= chunkSize && WholeRowsLength(std::string_view(data.data(), data.size()), source) != 0) {
+            break;
+        }
+        size_t size = data.size();
+        data.resize(size + std::max(chunkSize - std::min(size, chunkSize), size_t(64) << 10));
+        ssize_t count = read(source.fd, data.data() + size, data.size() - size);
+        if (count < 0 && errno == EINTR) {
+            data.resize(size);
+            continue;
+        }
+        if (count < 0) {
+            fprintf(stderr, "Error: Cannot read the input: %s\n", strerror(errno));
+            source.failed = true;
+            return false;
+        }
+        data.resize(size + count);
+        source.ended = count == 0;
+    }
+    size_t length = source.ended ? data.size() : WholeRowsLength(std::string_view(data.data(), data.size()), source);
+    source.pending.assign(data.begin() + length, data.end());
+    data.resize(length);
+    chunk.input = std::string_view(data.data(), data.size());
+    return length != 0;
+}
+
+// Gives the pages of a mapped file that only held rows up to chunk back to the system. They are
+// clean, so dropping them costs nothing, and without it they would add up to the whole file.
+static void ReleaseInput(InputSource& source, const Chunk& chunk)
+{
+    if (!source.file || source.file->getBufferKind() != MemoryBuffer::MemoryBuffer_MMap) {
+        return;
+    }
+    uintptr_t pageSize = sys::Process::getPageSizeEstimate();
+    uintptr_t end = reinterpret_cast<uintptr_t>(chunk.input.data() + chunk.input.size()) & ~(pageSize - 1);
+    if (end > source.releasedEnd) {
+        madvise(reinterpret_cast<void*>(source.releasedEnd), end - source.releasedEnd, MADV_DONTNEED);
+        source.releasedEnd = end;
+    }
+}
+
+static bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// Splits lines of comma separated numbers into one column per parameter. Empty lines are skipped.
+static bool ParseTextRows(Chunk& chunk, size_t argCount)
+{
+    const char* cur = chunk.input.data();
+    const char* end = cur + chunk.input.size();
+    for (; cur != end; chunk.rows++) {
+        const char* lineEnd = static_cast<const char*>(memchr(cur, '\n', end - cur));
+        const char* next = lineEnd ? lineEnd + 1 : end;
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        if (lineEnd != cur && lineEnd[-1] == '\r') {
+            lineEnd--;
+        }
+        const char* p = cur;
+        cur = next;
+        while (p != lineEnd && IsBlank(*p)) {
+            p++;
+        }
+        if (p == lineEnd) {
+            continue;
+        }
+        size_t fields = 0;
+        while (true) {
+            while (p != lineEnd && IsBlank(*p)) {
+                p++;
+            }
+            double value;
+            auto [valueEnd, error] = std::from_chars(p, lineEnd, value);
+            if (error != std::errc()) {
+                chunk.error = "Expected a number";
+                chunk.errorRow = chunk.rows;
+                return false;
+            }
+            if (fields < argCount) {
+                chunk.columns[fields].push_back(value);
+            }
+            fields++;
+            p = valueEnd;
+            while (p != lineEnd && IsBlank(*p)) {
+                p++;
+            }
+            if (p == lineEnd) {
+                break;
+            }
+            if (*p != ',') {
+                chunk.error = "Expected ',' between values";
+                chunk.errorRow = chunk.rows;
+                return false;
+            }
+            p++;
+        }
+        if (fields != argCount) {
+            chunk.error = "Found " + std::to_string(fields) + " values, expected " + std::to_string(argCount);
+            chunk.errorRow = chunk.rows;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Transposes rows of raw doubles into one column per parameter.
+static bool ParseBinaryRows(Chunk& chunk, size_t argCount)
+{
+    size_t rowSize = argCount * sizeof(double);
+    size_t count = chunk.input.size() / rowSize;
+    if (chunk.input.size() % rowSize != 0) {
+        chunk.error = "Input ends in the middle of a row";
+        chunk.errorRow = count;
+        return false;
+    }
+    const char* row = chunk.input.data();
+    for (std::vector<double>& column : chunk.columns) {
+        column.resize(count);
+    }
+    for (size_t i = 0; i < count; i++, row += rowSize) {
+        for (size_t arg = 0; arg < argCount; arg++) {
+            memcpy(&chunk.columns[arg][i], row + arg * sizeof(double), sizeof(double));
+        }
+    }
+    chunk.rows = count;
+    return true;
+}
+
+static void EvaluateChunk(Chunk& chunk, MapFunction map, size_t argCount, bool binary)
+{
+    chunk.columns.resize(argCount);
+    for (std::vector<double>& column : chunk.columns) {
+        column.clear();
+    }
+    chunk.output.clear();
+    if (!(binary ? ParseBinaryRows(chunk, argCount) : ParseTextRows(chunk, argCount))) {
+        return;
+    }
+    size_t count = chunk.columns[0].size();
+    std::vector<const double*> inputs;
+    for (const std::vector<double>& column : chunk.columns) {
+        inputs.push_back(column.data());
+    }
+    chunk.results.resize(count);
+    map(inputs.data(), chunk.results.data(), static_cast<int64_t>(count));
+
+    if (binary) {
+        chunk.output.assign(reinterpret_cast<const char*>(chunk.results.data()), count * sizeof(double));
+        return;
+    }
+    // Shortest representation that reads back as the same double; never longer than 24 characters.
+    constexpr size_t maxLength = 32;
+    chunk.output.resize(count * maxLength);
+    char* out = chunk.output.data();
+    for (double value : chunk.results) {
+        out = std::to_chars(out, out + maxLength, value).ptr;
+        *out++ = '\n';
+    }
+    chunk.output.resize(out - chunk.output.data());
+}
+
+bool StreamMap(MapFunction map, size_t argCount, const StreamMapOptions& options)
+{
+    if (argCount == 0) {
+        fprintf(stderr, "Error: Only functions with parameters can be mapped over rows\n");
+        return false;
+    }
+    InputSource source;
+    if (!OpenInput(source, options, argCount)) {
+        return false;
+    }
+
+    // Rounds of one chunk per thread: every chunk is evaluated as soon as it is read, and the
+    // results are written in input order once the whole round is done.
+    std::vector<Chunk> chunks(std::max(options.threads, 1u));
+    size_t rowsBefore = 0;
+    bool succeeded = true;
+    while (succeeded && !source.failed) {
+        std::vector<std::thread> workers;
+        for (Chunk& chunk : chunks) {
+            if (!ReadChunk(source, chunk)) {
+                break;
+            }
+            workers.emplace_back(EvaluateChunk, std::ref(chunk), map, argCount, options.binary);
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        if (workers.empty()) {
+            break;
+        }
+        for (size_t i = 0; i < workers.size() && succeeded; i++) {
+            Chunk& chunk = chunks[i];
+            if (!chunk.error.empty()) {
+                fprintf(stderr, "Error: %s %zu: %s\n", options.binary ? "Row" : "Line",
+                    rowsBefore + chunk.errorRow + 1, chunk.error.c_str());
+                succeeded = false;
+            } else if (fwrite(chunk.output.data(), 1, chunk.output.size(), stdout) != chunk.output.size()) {
+                fprintf(stderr, "Error: Cannot write the results: %s\n", strerror(errno));
+                succeeded = false;
+            }
+            ReleaseInput(source, chunk);
+            rowsBefore += chunk.rows;
+        }
+    }
+    fflush(stdout);
+    return succeeded && !source.failed;
+}
@@ -1,11 +1,113 @@
 #include "CompilerInstance.h"
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 int main(int argc, char* argv[]) {
+    CompilerOptions options;
+    bool quiet = false;
+    bool dumpAST = false;
+    bool dumpIR = false;
+    bool debugPassManager = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lazy") == 0) {
+            options.lazy = true;
+        } else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0') {
+            options.optLevel = argv[i][2] - '0';
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            options.cacheDir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--emit-obj=", 11) == 0) {
+            options.emitObject = argv[i] + 11;
+        } else if (strncmp(argv[i], "--emit-shared=", 14) == 0) {
+            options.emitShared = argv[i] + 14;
+        } else if (strncmp(argv[i], "--compile-threads=", 18) == 0) {
+            options.compileThreads = std::atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--parse-threads=", 16) == 0) {
+            options.parseThreads = std::atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--tier-threshold=", 17) == 0) {
+            options.tierThreshold = std::atoi(argv[i] + 17);
+        } else if (strncmp(argv[i], "--reopt-threshold=", 18) == 0) {
+            options.reoptimizeThreshold = std::strtoull(argv[i] + 18, nullptr, 10);
+        } else if (strncmp(argv[i], "--spec-cache-size=", 18) == 0) {
+            options.specializationCacheSize = std::atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--memo-capacity=", 16) == 0) {
+            options.memoCapacity = std::strtoull(argv[i] + 16, nullptr, 10);
+        } else if (strcmp(argv[i], "--memo-eviction=replace") == 0) {
+            options.memoReplace = true;
+        } else if (strcmp(argv[i], "--memo-eviction=keep") == 0) {
+            options.memoReplace = false;
+        } else if (strncmp(argv[i], "--veclib=", 9) == 0) {
+            options.vectorLibrary = argv[i] + 9;
+        } else if (strncmp(argv[i], "--veclib-path=", 14) == 0) {
+            options.vectorLibraryPath = argv[i] + 14;
+        } else if (strncmp(argv[i], "--map=", 6) == 0) {
+            options.mapFunction = argv[i] + 6;
+        } else if (strncmp(argv[i], "--map-input=", 12) == 0) {
+            options.mapInput = argv[i] + 12;
+        } else if (strcmp(argv[i], "--map-binary") == 0) {
+            options.mapBinary = true;
+        } else if (strncmp(argv[i], "--map-threads=", 14) == 0) {
+            options.mapThreads = std::atoi(argv[i] + 14);
+        } else if (strcmp(argv[i], "--time-phases") == 0) {
+            options.timePhases = true;
+        } else if (strncmp(argv[i], "--time-phases=", 14) == 0) {
+            options.timePhases = true;
+            options.timePhasesFile = argv[i] + 14;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options.timePhases = true;
+            options.statistics = true;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            options.debugInfo = true;
+        } else if (strcmp(argv[i], "--perf-map") == 0) {
+            options.perfMap = true;
+        } else if (strcmp(argv[i], "--gdb-jit") == 0) {
+            options.gdbRegistration = true;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "--dump-ast") == 0) {
+            dumpAST = true;
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            dumpIR = true;
+        } else if (strcmp(argv[i], "--debug-pass-manager") == 0) {
+            debugPassManager = true;
+        } else if (argv[i][0] != '-') {
+            options.inputFile = argv[i];
+        } else {
+            std::cerr << "Unrecognized option: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    // The REPL shows its work unless told to be quiet. Running a file prints only results unless
+    // a dump is asked for.
+    bool verbose = options.inputFile.empty() && !quiet;
+    options.dumpAST = dumpAST || verbose;
+    options.dumpIR = dumpIR || verbose;
+    options.debugPassManager = debugPassManager || verbose;
+    options.prompt = verbose;
+
+    if (!options.emitObject.empty() || !options.emitShared.empty()) {
+        if (options.inputFile.empty()) {
+            std::cerr << "Compiling ahead of time needs an input file" << std::endl;
+            return 1;
+        }
+        return CompileFile(options) ? 0 : 1;
+    }
+    if (!options.mapFunction.empty()) {
+        if (options.inputFile.empty()) {
+            std::cerr << "Mapping a function needs the input file defining it" << std::endl;
+            return 1;
+        }
+        return MapFile(options) ? 0 : 1;
+    }
+    if (!options.inputFile.empty()) {
+        return RunFile(options) ? 0 : 1;
+    }
+
     std::cout << "Kaleidoscope project!" << std::endl;
 
-    ReadEvalPrintLoop();
+    ReadEvalPrintLoop(options);
 
     return 0;
 }
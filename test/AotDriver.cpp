@@ -0,0 +1,29 @@
+// Calls the functions of aot.kal, linked in from the object file or the shared library main
+// compiled it into. Returns nonzero if any result is wrong.
+
+#include <cmath>
+#include <cstdio>
+
+extern "C" double f(double);
+extern "C" double fib(double);
+extern "C" double mix(double, double);
+extern "C" double norm(double, double);
+
+static int failures = 0;
+
+static void Check(const char* call, double actual, double expected)
+{
+    if (std::fabs(actual - expected) > 1e-12) {
+        fprintf(stderr, "%s returned %g, expected %g\n", call, actual, expected);
+        failures++;
+    }
+}
+
+int main()
+{
+    Check("f(3)", f(3), 10);
+    Check("fib(20)", fib(20), 6765);
+    Check("mix(1, 2)", mix(1, 2), 1.75);
+    Check("norm(3, 4)", norm(3, 4), 5);
+    return failures == 0 ? 0 : 1;
+}
@@ -14,17 +14,23 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include <limits>
 #include <memory>
 
 namespace llvm {
@@ -33,28 +39,57 @@ namespace orc {
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
 
+  JITTargetMachineBuilder JTMB;
   DataLayout DL;
   MangleAndInterner Mangle;
 
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  CompileOnDemandLayer CODLayer;
+
+  // Stubs that callers bind to in place of redefinable functions.
+  std::unique_ptr<IndirectStubsManager> ISM;
 
   JITDylib &MainJD;
 
+  // When set, modules go through CODLayer and each function is only compiled
+  // the first time it is called.
+  bool Lazy;
+
+  static double handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body\n";
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+
+  // Stands in for a function taking any number of doubles, so the process
+  // embedding the JIT keeps running.
+  static double handleUnresolvedStubCall() {
+    errs() << "Error: Called a function whose definition failed to compile\n";
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  JITTargetMachineBuilder JTMB, DataLayout DL, bool Lazy,
+                  ObjectCache *Cache = nullptr)
+      : ES(std::move(ES)), EPCIU(std::move(EPCIU)), JTMB(std::move(JTMB)),
+        DL(std::move(DL)), Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                     std::make_unique<ConcurrentIRCompiler>(this->JTMB, Cache)),
+        CODLayer(*this->ES, CompileLayer,
+                 this->EPCIU->getLazyCallThroughManager(),
+                 [this] { return this->EPCIU->createIndirectStubsManager(); }),
+        ISM(this->EPCIU->createIndirectStubsManager()),
+        MainJD(this->ES->createBareJITDylib("<main>")), Lazy(Lazy) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    if (this->JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
@@ -63,36 +98,117 @@ public:
   ~KaleidoscopeJIT() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (auto Err = EPCIU->cleanup())
+      ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  // When a cache is given, the compile layer asks it for every module before
+  // running the code generator and hands it every object compiled.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(bool Lazy = false, CodeGenOpt::Level OptLevel = CodeGenOpt::Default,
+         ObjectCache *Cache = nullptr) {
+    // Materialization tasks run on a thread pool, so modules that are looked
+    // up together are compiled in parallel.
+    auto EPC = SelfExecutorProcessControl::Create(
+        nullptr, std::make_unique<DynamicThreadPoolTaskDispatcher>());
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    auto EPCIU = EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+    if (!EPCIU)
+      return EPCIU.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    (*EPCIU)->createLazyCallThroughManager(
+        *ES, pointerToJITTargetAddress(&handleLazyCallThroughError));
+
+    if (auto Err = setUpInProcessLCTMReentryViaEPCIU(**EPCIU))
+      return std::move(Err);
+
+    // Target the host CPU and its features, so the optimizer and the code
+    // generator can use every instruction available.
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
+    JTMB->setCodeGenOptLevel(OptLevel);
+
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*EPCIU),
+                                             std::move(*JTMB), std::move(*DL),
+                                             Lazy, Cache);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  const JITTargetMachineBuilder &getTargetMachineBuilder() const {
+    return JTMB;
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // Tells L about every object the JIT loads, so that debuggers and profilers
+  // can name the code in it.
+  void registerJITEventListener(JITEventListener &L) {
+    ObjectLayer.registerJITEventListener(L);
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    if (Lazy)
+      return CODLayer.add(RT, std::move(TSM));
+    return CompileLayer.add(RT, std::move(TSM));
+  }
+
+  // Compiles the module up front even in lazy mode, for code that is about to
+  // run anyway.
+  Error addEagerModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  // Defines Name in the main JITDylib as an indirect stub. Code that calls Name
+  // jumps through the stub, whose target is set with redirectStub. Until then,
+  // calling it reports an error.
+  Error createStub(StringRef Name) {
+    if (auto Err = ISM->createStub(
+            Name, pointerToJITTargetAddress(&handleUnresolvedStubCall),
+            JITSymbolFlags::Exported))
+      return Err;
+    auto Stub = ISM->findStub(Name, true);
+    return MainJD.define(absoluteSymbols({{Mangle(Name.str()), Stub}}));
+  }
+
+  // Atomically points the stub Name at ImplName, which must already have been
+  // added. In lazy mode ImplName resolves to its lazy stub and is not compiled.
+  Error redirectStub(StringRef Name, StringRef ImplName) {
+    auto Impl = lookup(ImplName);
+    if (!Impl)
+      return Impl.takeError();
+    return ISM->updatePointer(Name, Impl->getAddress());
+  }
+
+  // Points every stub at its implementation with a single lookup, so the
+  // modules defining them are compiled in parallel.
+  Error redirectStubs(ArrayRef<std::pair<std::string, std::string>> Redirects) {
+    SymbolLookupSet ImplNames;
+    for (auto &Redirect : Redirects)
+      ImplNames.add(Mangle(Redirect.second));
+    auto Impls = ES->lookup(makeJITDylibSearchOrder(&MainJD), ImplNames);
+    if (!Impls)
+      return Impls.takeError();
+    for (auto &Redirect : Redirects)
+      if (auto Err = ISM->updatePointer(
+              Redirect.first, (*Impls)[Mangle(Redirect.second)].getAddress()))
+        return Err;
+    return Error::success();
+  }
+
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }